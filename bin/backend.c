@@ -0,0 +1,637 @@
+/*
+ * (C) 2014-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/hidraw.h>
+#include <linux/limits.h>
+
+#include <yubikey.h>
+#include <ykpers-1/ykdef.h>
+#include <ykpers-1/ykcore.h>
+
+#include "../config.h"
+#include "backend.h"
+#include "sha1.h"
+
+/* maximum number of keys the soft backend emulates */
+#define SOFT_MAX	8
+
+/* maximum number of keys the hidraw backend keeps open */
+#define HIDRAW_MAX	8
+/* OTP interface protocol, as spoken by ykpers: feature reports
+ * of seven bytes payload and a status byte */
+#define HIDRAW_REPORT_SIZE	8
+#define HIDRAW_DATA_SIZE	7
+#define HIDRAW_WRITE_FLAG	0x80
+#define HIDRAW_PENDING_FLAG	0x40
+#define HIDRAW_TOUCH_FLAG	0x20
+#define HIDRAW_SEQUENCE_MASK	0x1f
+#define HIDRAW_RESET		0x8f
+/* a frame is sent in this many chunks at most */
+#define HIDRAW_CHUNKS		(sizeof(struct hidraw_frame) / HIDRAW_DATA_SIZE)
+/* polling starts short and doubles up to the maximum,
+ * timeouts for the key to react and for touch */
+#define HIDRAW_POLL_MIN		100
+#define HIDRAW_POLL_MAX		20000
+#define HIDRAW_TIMEOUT		1000000
+#define HIDRAW_TOUCH_TIMEOUT	15000000
+
+/*** ykpers backend ***/
+/* ykpers has its own error numbers, callers expect errno */
+static int ykpers_errno(int rc) {
+	if (rc != 0)
+		return rc;
+
+	switch (yk_errno) {
+		case YK_ENOKEY:
+			errno = ENODEV;
+			break;
+		case YK_ETIMEOUT:
+			errno = ETIMEDOUT;
+			break;
+		case YK_EWOULDBLOCK:
+			errno = EWOULDBLOCK;
+			break;
+		case YK_EUSBERR:
+		case YK_EWRITEERR:
+		case YK_ENOSTATUS:
+			errno = EIO;
+			break;
+		default:
+			errno = EPROTO;
+			break;
+	}
+
+	return rc;
+}
+
+static int ykpers_init(dictionary * ini) {
+	return yk_init();
+}
+
+static BACKEND_KEY * ykpers_open_key(int index) {
+	YK_KEY * yk;
+
+	if ((yk = yk_open_key(index)) == NULL)
+		ykpers_errno(0);
+
+	return (BACKEND_KEY *) yk;
+}
+
+static int ykpers_close_key(BACKEND_KEY * key) {
+	return yk_close_key((YK_KEY *) key);
+}
+
+static int ykpers_get_serial(BACKEND_KEY * key, unsigned int * serial) {
+	return ykpers_errno(yk_get_serial((YK_KEY *) key, 0, 0, serial));
+}
+
+static int ykpers_challenge_response(BACKEND_KEY * key, uint8_t slot, int may_block,
+		unsigned int challenge_len, const unsigned char * challenge,
+		unsigned int response_len, unsigned char * response) {
+	return ykpers_errno(yk_challenge_response((YK_KEY *) key, slot, may_block,
+			challenge_len, challenge, response_len, response));
+}
+
+/*** soft backend ***/
+/* Emulates Yubikeys configured for HMAC-SHA1 in fixed 64 byte mode.
+ * The secret file has one line per emulated key, each with decimal
+ * serial number and hex encoded secret:
+ *
+ * 1234567 0123456789abcdef0123456789abcdef01234567 */
+struct soft_key {
+	unsigned int serial;
+	size_t secret_len;
+	uint8_t secret[SHA1_BLOCKLEN];
+};
+
+static struct soft_key soft_keys[SOFT_MAX];
+static unsigned int soft_count = 0;
+
+static int soft_init(dictionary * ini) {
+	const char * secretfilename;
+	FILE * secretfile;
+	char * line = NULL, hex[SHA1_BLOCKLEN * 2 + 1];
+	size_t len = 0;
+	struct soft_key * key;
+
+	if ((secretfilename = iniparser_getstring(ini, "general:" CONFSOFTSECRET, NULL)) == NULL) {
+		fprintf(stderr, "No secret file given for soft backend.\n");
+		return 0;
+	}
+
+	if ((secretfile = fopen(secretfilename, "r")) == NULL) {
+		perror("Failed opening secret file for reading");
+		return 0;
+	}
+
+	soft_count = 0;
+	while (soft_count < SOFT_MAX && getline(&line, &len, secretfile) > 0) {
+		key = &soft_keys[soft_count];
+
+		if (sscanf(line, "%u %128s", &key->serial, hex) != 2 ||
+				strlen(hex) % 2 != 0 || yubikey_hex_p(hex) == 0)
+			continue;
+
+		key->secret_len = strlen(hex) / 2;
+		yubikey_hex_decode((char *) key->secret, hex, key->secret_len);
+		soft_count++;
+	}
+
+	memset(hex, 0, sizeof(hex));
+	if (line != NULL) {
+		memset(line, 0, len);
+		free(line);
+	}
+	fclose(secretfile);
+
+	return 1;
+}
+
+static int soft_release(void) {
+	memset(soft_keys, 0, sizeof(soft_keys));
+	soft_count = 0;
+
+	return 1;
+}
+
+static BACKEND_KEY * soft_open_key(int index) {
+	if (index < 0 || index >= soft_count) {
+		errno = ENODEV;
+		return NULL;
+	}
+
+	return (BACKEND_KEY *) &soft_keys[index];
+}
+
+static int soft_close_key(BACKEND_KEY * key) {
+	return 1;
+}
+
+static int soft_get_serial(BACKEND_KEY * key, unsigned int * serial) {
+	*serial = ((struct soft_key *) key)->serial;
+
+	return 1;
+}
+
+static int soft_challenge_response(BACKEND_KEY * key, uint8_t slot, int may_block,
+		unsigned int challenge_len, const unsigned char * challenge,
+		unsigned int response_len, unsigned char * response) {
+	struct soft_key * soft = (struct soft_key *) key;
+
+	if (response_len < SHA1_HASHLEN) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	memset(response, 0, response_len);
+	hmac_sha1(soft->secret, soft->secret_len, challenge, challenge_len, response);
+
+	return 1;
+}
+
+/*** hidraw backend ***/
+/* Talks to the OTP interface of Yubikeys on /dev/hidraw* directly,
+ * without libusb enumeration and with polling that adapts to what
+ * the key took last time. Opened keys are kept open until release. */
+struct hidraw_frame {
+	uint8_t payload[SHA1_MAX_BLOCK_SIZE];
+	uint8_t slot;
+	uint8_t crc[2];
+	uint8_t filler[3];
+};
+
+struct hidraw_key {
+	char name[NAME_MAX + 1];
+	int fd;
+	bool used;
+	/* time the last response took, in microseconds */
+	uint64_t latency;
+};
+
+static struct hidraw_key hidraw_keys[HIDRAW_MAX];
+
+static uint64_t hidraw_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void hidraw_sleep(uint64_t usec) {
+	struct timespec ts = {
+		.tv_sec = usec / 1000000,
+		.tv_nsec = (usec % 1000000) * 1000,
+	};
+
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+static int hidraw_init(dictionary * ini) {
+	unsigned int i;
+
+	for (i = 0; i < HIDRAW_MAX; i++)
+		hidraw_keys[i].fd = -1;
+
+	return 1;
+}
+
+static int hidraw_release(void) {
+	unsigned int i;
+
+	for (i = 0; i < HIDRAW_MAX; i++)
+		if (hidraw_keys[i].fd >= 0)
+			close(hidraw_keys[i].fd);
+
+	memset(hidraw_keys, 0, sizeof(hidraw_keys));
+
+	return 1;
+}
+
+/* the OTP interface is the one with keyboard usage */
+static bool hidraw_is_otp(int fd) {
+	struct hidraw_devinfo info;
+	struct hidraw_report_descriptor desc;
+	static const uint8_t keyboard[] = { 0x05, 0x01, 0x09, 0x06 };
+	int size;
+
+	if (ioctl(fd, HIDIOCGRAWINFO, &info) < 0 || (uint16_t) info.vendor != YUBICO_VID)
+		return false;
+
+	if (ioctl(fd, HIDIOCGRDESCSIZE, &size) < 0 || size < sizeof(keyboard))
+		return false;
+
+	desc.size = sizeof(keyboard);
+	if (ioctl(fd, HIDIOCGRDESC, &desc) < 0)
+		return false;
+
+	return memcmp(desc.value, keyboard, sizeof(keyboard)) == 0;
+}
+
+static int hidraw_filter(const struct dirent * ent) {
+	return strncmp(ent->d_name, "hidraw", 6) == 0;
+}
+
+static BACKEND_KEY * hidraw_open_key(int index) {
+	struct hidraw_key * key = NULL, * cached;
+	struct dirent ** ents;
+	char path[PATH_MAX];
+	int i, j, count, found = 0, fd;
+
+	if ((count = scandir("/dev", &ents, hidraw_filter, versionsort)) < 0)
+		return NULL;
+
+	for (i = 0; i < count && key == NULL; i++) {
+		/* reuse the fd if we have it open already */
+		cached = NULL;
+		for (j = 0; j < HIDRAW_MAX; j++)
+			if (hidraw_keys[j].fd >= 0 && strcmp(hidraw_keys[j].name, ents[i]->d_name) == 0)
+				cached = &hidraw_keys[j];
+
+		if (cached != NULL && hidraw_is_otp(cached->fd) == false) {
+			close(cached->fd);
+			cached->fd = -1;
+			cached = NULL;
+		}
+
+		if (cached == NULL) {
+			snprintf(path, sizeof(path), "/dev/%s", ents[i]->d_name);
+			if ((fd = open(path, O_RDWR | O_CLOEXEC)) < 0)
+				continue;
+			if (hidraw_is_otp(fd) == false) {
+				close(fd);
+				continue;
+			}
+			for (j = 0; j < HIDRAW_MAX && cached == NULL; j++)
+				if (hidraw_keys[j].fd < 0)
+					cached = &hidraw_keys[j];
+			if (cached == NULL) {
+				close(fd);
+				break;
+			}
+			memset(cached, 0, sizeof(struct hidraw_key));
+			strcpy(cached->name, ents[i]->d_name);
+			cached->fd = fd;
+		}
+
+		if (found++ == index)
+			key = cached;
+	}
+
+	for (i = 0; i < count; i++)
+		free(ents[i]);
+	free(ents);
+
+	if (key == NULL) {
+		errno = ENODEV;
+		return NULL;
+	}
+
+	if (key->used == true) {
+		errno = EBUSY;
+		return NULL;
+	}
+	key->used = true;
+
+	return (BACKEND_KEY *) key;
+}
+
+static int hidraw_close_key(BACKEND_KEY * backend_key) {
+	/* the fd stays open for next time */
+	((struct hidraw_key *) backend_key)->used = false;
+
+	return 1;
+}
+
+static int hidraw_get(struct hidraw_key * key, uint8_t * report) {
+	/* report id 0 goes first, for unnumbered reports */
+	uint8_t buffer[HIDRAW_REPORT_SIZE + 1] = { 0 };
+
+	if (ioctl(key->fd, HIDIOCGFEATURE(sizeof(buffer)), buffer) < 0)
+		return 0;
+
+	memcpy(report, buffer + 1, HIDRAW_REPORT_SIZE);
+
+	return 1;
+}
+
+static int hidraw_set(struct hidraw_key * key, const uint8_t * report) {
+	uint8_t buffer[HIDRAW_REPORT_SIZE + 1] = { 0 };
+
+	memcpy(buffer + 1, report, HIDRAW_REPORT_SIZE);
+
+	return ioctl(key->fd, HIDIOCSFEATURE(sizeof(buffer)), buffer) >= 0;
+}
+
+static void hidraw_reset(struct hidraw_key * key) {
+	uint8_t report[HIDRAW_REPORT_SIZE] = { 0 };
+
+	report[HIDRAW_REPORT_SIZE - 1] = HIDRAW_RESET;
+	hidraw_set(key, report);
+}
+
+/* Poll status until flag is set (or cleared). The first interval is
+ * a guess, then it doubles, so a fast key is not kept waiting and a
+ * slow one is not polled to death. */
+static int hidraw_wait(struct hidraw_key * key, uint8_t flag, bool set, int may_block,
+		uint64_t interval, uint8_t * report) {
+	uint64_t deadline;
+
+	deadline = hidraw_now() + (may_block ? HIDRAW_TOUCH_TIMEOUT : HIDRAW_TIMEOUT);
+
+	while (1) {
+		if (hidraw_get(key, report) == 0)
+			return 0;
+
+		if (((report[HIDRAW_REPORT_SIZE - 1] & flag) != 0) == set)
+			return 1;
+
+		/* the key waits for touch */
+		if ((report[HIDRAW_REPORT_SIZE - 1] & HIDRAW_TOUCH_FLAG) != 0 && may_block == 0) {
+			hidraw_reset(key);
+			errno = EWOULDBLOCK;
+			return 0;
+		}
+
+		if (hidraw_now() > deadline) {
+			hidraw_reset(key);
+			errno = ETIMEDOUT;
+			return 0;
+		}
+
+		hidraw_sleep(interval);
+		if ((interval *= 2) > HIDRAW_POLL_MAX)
+			interval = HIDRAW_POLL_MAX;
+	}
+}
+
+/* The frame goes with payload, slot and crc. It is split into chunks
+ * with sequence number, those with zeros only are skipped - but the
+ * first and the last. Returns the number of reports to send. */
+static unsigned int hidraw_frame(uint8_t slot, const unsigned char * data, unsigned int len,
+		uint8_t reports[HIDRAW_CHUNKS][HIDRAW_REPORT_SIZE]) {
+	struct hidraw_frame frame;
+	const uint8_t * ptr, * end;
+	uint16_t crc;
+	uint8_t seq;
+	unsigned int count = 0;
+	int i, zero;
+
+	if (len > sizeof(frame.payload))
+		return 0;
+
+	memset(&frame, 0, sizeof(frame));
+	memcpy(frame.payload, data, len);
+	frame.slot = slot;
+	crc = yubikey_crc16(frame.payload, sizeof(frame.payload));
+	frame.crc[0] = crc & 0xff;
+	frame.crc[1] = crc >> 8;
+
+	ptr = (const uint8_t *) &frame;
+	end = ptr + sizeof(frame);
+	for (seq = 0; ptr < end; ptr += HIDRAW_DATA_SIZE, seq++) {
+		for (i = 0, zero = 1; i < HIDRAW_DATA_SIZE; i++)
+			if (ptr[i] != 0)
+				zero = 0;
+		if (zero == 1 && seq > 0 && ptr + HIDRAW_DATA_SIZE < end)
+			continue;
+
+		memcpy(reports[count], ptr, HIDRAW_DATA_SIZE);
+		reports[count++][HIDRAW_REPORT_SIZE - 1] = HIDRAW_WRITE_FLAG | seq;
+	}
+
+	memset(&frame, 0, sizeof(frame));
+
+	return count;
+}
+
+/* The response is followed by its crc, the crc over both
+ * gives a fixed residue. */
+static bool hidraw_crc_ok(const uint8_t * buffer, unsigned int len, unsigned int expect) {
+	return len >= expect + 2 &&
+		yubikey_crc16(buffer, expect + 2) == YUBIKEY_CRC_OK_RESIDUE;
+}
+
+static int hidraw_write(struct hidraw_key * key, uint8_t slot,
+		const unsigned char * data, unsigned int len) {
+	uint8_t reports[HIDRAW_CHUNKS][HIDRAW_REPORT_SIZE], status[HIDRAW_REPORT_SIZE];
+	unsigned int count, i;
+	int rc = 0;
+
+	if ((count = hidraw_frame(slot, data, len, reports)) == 0) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	for (i = 0; i < count; i++)
+		if (hidraw_wait(key, HIDRAW_WRITE_FLAG, false, 0, HIDRAW_POLL_MIN, status) == 0 ||
+				hidraw_set(key, reports[i]) == 0)
+			goto out;
+
+	rc = 1;
+
+out:
+	memset(reports, 0, sizeof(reports));
+
+	return rc;
+}
+
+static int hidraw_read(struct hidraw_key * key, int may_block,
+		unsigned char * response, unsigned int expect) {
+	uint8_t report[HIDRAW_REPORT_SIZE], buffer[sizeof(struct hidraw_frame)];
+	unsigned int len = 0;
+	uint64_t start, interval;
+
+	/* start polling a bit before the response is expected */
+	if ((interval = key->latency * 3 / 4) < HIDRAW_POLL_MIN)
+		interval = HIDRAW_POLL_MIN;
+
+	start = hidraw_now();
+	if (hidraw_wait(key, HIDRAW_PENDING_FLAG, true, may_block, interval, report) == 0)
+		return 0;
+
+	/* Touch is not what we learn from. Without, remember
+	 * what the key took, weighted with history. */
+	if ((report[HIDRAW_REPORT_SIZE - 1] & HIDRAW_TOUCH_FLAG) == 0)
+		key->latency = key->latency == 0 ? hidraw_now() - start :
+			(key->latency * 3 + hidraw_now() - start) / 4;
+
+	/* the sequence wraps to zero after last chunk */
+	do {
+		memcpy(buffer + len, report, HIDRAW_DATA_SIZE);
+		len += HIDRAW_DATA_SIZE;
+		if (hidraw_get(key, report) == 0)
+			return 0;
+	} while ((report[HIDRAW_REPORT_SIZE - 1] & HIDRAW_PENDING_FLAG) != 0 &&
+			(report[HIDRAW_REPORT_SIZE - 1] & HIDRAW_SEQUENCE_MASK) != 0 &&
+			len + HIDRAW_DATA_SIZE <= sizeof(buffer));
+
+	hidraw_reset(key);
+
+	if (hidraw_crc_ok(buffer, len, expect) == false) {
+		memset(buffer, 0, sizeof(buffer));
+		errno = EIO;
+		return 0;
+	}
+
+	memcpy(response, buffer, expect);
+	memset(buffer, 0, sizeof(buffer));
+
+	return 1;
+}
+
+static int hidraw_get_serial(BACKEND_KEY * backend_key, unsigned int * serial) {
+	struct hidraw_key * key = (struct hidraw_key *) backend_key;
+	unsigned char buffer[4];
+
+	if (hidraw_write(key, SLOT_DEVICE_SERIAL, NULL, 0) == 0 ||
+			hidraw_read(key, 0, buffer, sizeof(buffer)) == 0)
+		return 0;
+
+	/* serial number is big endian */
+	*serial = (unsigned int) buffer[0] << 24 | buffer[1] << 16 | buffer[2] << 8 | buffer[3];
+
+	return 1;
+}
+
+static int hidraw_challenge_response(BACKEND_KEY * backend_key, uint8_t slot, int may_block,
+		unsigned int challenge_len, const unsigned char * challenge,
+		unsigned int response_len, unsigned char * response) {
+	struct hidraw_key * key = (struct hidraw_key *) backend_key;
+
+	if (response_len < SHA1_DIGEST_SIZE) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	memset(response, 0, response_len);
+
+	return hidraw_write(key, slot, challenge, challenge_len) != 0 &&
+		hidraw_read(key, may_block, response, SHA1_DIGEST_SIZE) != 0;
+}
+
+static const struct backend backends[] = {
+	{
+		.name = "ykpers",
+		.init = ykpers_init,
+		.release = yk_release,
+		.open_key = ykpers_open_key,
+		.close_key = ykpers_close_key,
+		.get_serial = ykpers_get_serial,
+		.challenge_response = ykpers_challenge_response,
+	},
+	{
+		.name = "hidraw",
+		.init = hidraw_init,
+		.release = hidraw_release,
+		.open_key = hidraw_open_key,
+		.close_key = hidraw_close_key,
+		.get_serial = hidraw_get_serial,
+		.challenge_response = hidraw_challenge_response,
+	},
+	{
+		.name = "soft",
+		.init = soft_init,
+		.release = soft_release,
+		.open_key = soft_open_key,
+		.close_key = soft_close_key,
+		.get_serial = soft_get_serial,
+		.challenge_response = soft_challenge_response,
+	},
+	{ 0 }
+};
+
+/*** backend_init ***/
+const struct backend * backend_init(dictionary * ini) {
+	const struct backend * backend;
+	const char * name = NULL;
+
+	if (ini != NULL)
+		name = iniparser_getstring(ini, "general:" CONFBACKEND, NULL);
+	if (name == NULL)
+		name = backends[0].name;
+
+	for (backend = backends; backend->name != NULL; backend++) {
+		if (strcmp(backend->name, name) != 0)
+			continue;
+
+		if (backend->init(ini) == 0) {
+			fprintf(stderr, "Failed initializing backend %s.\n", name);
+			return NULL;
+		}
+
+		return backend;
+	}
+
+	fprintf(stderr, "Unknown backend %s.\n", name);
+
+	return NULL;
+}
@@ -0,0 +1,47 @@
+/*
+ * (C) 2014-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _BACKEND_H
+#define _BACKEND_H
+
+#include <stdint.h>
+
+#include <iniparser/iniparser.h>
+
+/* opaque handle for an opened key, its meaning depends on backend */
+typedef struct backend_key BACKEND_KEY;
+
+/* Challenge-response backend. The functions follow ykpers
+ * semantics: they return non-zero on success and zero on failure,
+ * open_key() returns NULL with errno set to ENODEV if there is no
+ * key with given index. */
+struct backend {
+	const char * name;
+	int (*init)(dictionary * ini);
+	int (*release)(void);
+	BACKEND_KEY * (*open_key)(int index);
+	int (*close_key)(BACKEND_KEY * key);
+	int (*get_serial)(BACKEND_KEY * key, unsigned int * serial);
+	int (*challenge_response)(BACKEND_KEY * key, uint8_t slot, int may_block,
+			unsigned int challenge_len, const unsigned char * challenge,
+			unsigned int response_len, unsigned char * response);
+};
+
+const struct backend * backend_init(dictionary * ini);
+
+#endif /* _BACKEND_H */
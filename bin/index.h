@@ -0,0 +1,71 @@
+/*
+ * (C) 2014-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _INDEX_H
+#define _INDEX_H
+
+#include <stdint.h>
+
+/* Binary index written by ykfde-cpio and mapped by libykfde. It holds
+ * config and challenge for every enrolled serial, so nothing has to be
+ * parsed in initramfs. The index is built on the host that boots it,
+ * so native byte order is fine. Bump the version on any change, a
+ * reader falls back to config and challenge files on mismatch. */
+#define INDEX_MAGIC	"YKFDEIDX"
+#define INDEX_VERSION	1
+
+/* flags in header */
+#define INDEX_2NDFACTOR	0x1
+#define INDEX_ACTIVATE	0x2
+/* config file has settings that are not in the index */
+#define INDEX_CONFIG	0x4
+#define INDEX_REUSE	0x8
+#define INDEX_DERIVE	0x10
+
+/* length of device name list, including terminating null */
+#define INDEX_NAMESLEN	128
+
+struct index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint32_t count;
+	/* number of entries following, a power of two */
+	uint32_t buckets;
+};
+
+/* The entries are an open addressing hash table with linear
+ * probing, serial 0 marks an empty bucket. */
+struct index_entry {
+	uint32_t serial;
+	/* yk slot is 1 or 2, luks slot is -1 if not set */
+	uint8_t yk_slot;
+	int8_t luks_slot;
+	uint16_t reserved;
+	char challenge[64];
+	char device_names[INDEX_NAMESLEN];
+};
+
+/*** index_bucket ***/
+static inline uint32_t index_bucket(uint32_t serial, uint32_t buckets) {
+	/* multiplicative hashing, the multiplier is odd so sequential
+	 * serials never share a bucket */
+	return (serial * 2654435761u) & (buckets - 1);
+}
+
+#endif /* _INDEX_H */
@@ -0,0 +1,490 @@
+/*
+ * (C) 2014-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <keyutils.h>
+
+#include <yubikey.h>
+
+#include "../config.h"
+#include "index.h"
+#include "libykfde.h"
+#include "probes.h"
+#include "sha1.h"
+
+/* delimiters for a list of devices in 'device name' */
+#define DEVICES_DELIM	" \t,"
+/* maximum length of a config key with section */
+#define CONFKEYLEN	128
+/* salt and info for HKDF, the info is followed by the LUKS UUID */
+#define DERIVESALT	"ykfde"
+#define DERIVEINFO	"ykfde luks "
+#define UUIDLEN		36
+
+static dictionary * ykfde_ini = NULL;
+static const struct backend * backend = NULL;
+static const struct index_header * index_map = NULL;
+static size_t index_size = 0;
+
+/*** ykfde_init ***/
+int ykfde_init(dictionary * ini) {
+	ykfde_ini = ini;
+
+	if ((backend = backend_init(ini)) == NULL)
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
+
+/*** ykfde_release ***/
+void ykfde_release(void) {
+	if (backend != NULL && backend->release() == 0)
+		perror("release() failed");
+
+	backend = NULL;
+	ykfde_ini = NULL;
+}
+
+/*** ykfde_index_open ***/
+int ykfde_index_open(const char * path, uint32_t * flags) {
+	int rc = EXIT_FAILURE, fd;
+	struct stat st;
+	void * map;
+	const struct index_header * header;
+
+	/* the index is optional, a missing file is no error */
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		if (errno != ENOENT)
+			perror("Failed opening index for reading");
+		return rc;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		perror("fstat() failed");
+		goto out;
+	}
+
+	if (st.st_size < sizeof(struct index_header)) {
+		fprintf(stderr, "Index %s is truncated.\n", path);
+		goto out;
+	}
+
+	if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		perror("mmap() failed");
+		goto out;
+	}
+
+	/* a mismatch is not fatal, we fall back to files */
+	header = map;
+	if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+			header->version != INDEX_VERSION || header->buckets == 0 ||
+			(header->buckets & (header->buckets - 1)) != 0 ||
+			st.st_size != sizeof(struct index_header) +
+				(size_t) header->buckets * sizeof(struct index_entry)) {
+		fprintf(stderr, "Index %s has unknown format, ignoring.\n", path);
+		munmap(map, st.st_size);
+		goto out;
+	}
+
+	ykfde_index_close();
+	index_map = header;
+	index_size = st.st_size;
+	*flags = index_map->flags;
+
+	rc = EXIT_SUCCESS;
+
+out:
+	close(fd);
+
+	return rc;
+}
+
+/*** ykfde_index_close ***/
+void ykfde_index_close(void) {
+	if (index_map == NULL)
+		return;
+
+	munmap((void *) index_map, index_size);
+	index_map = NULL;
+	index_size = 0;
+}
+
+/*** index_lookup ***/
+static const struct index_entry * index_lookup(unsigned int serial) {
+	const struct index_entry * entries = (const struct index_entry *) (index_map + 1);
+	uint32_t i, n;
+
+	if (serial == 0)
+		return NULL;
+
+	/* the table is never full, we hit an empty bucket eventually */
+	i = index_bucket(serial, index_map->buckets);
+	for (n = 0; n < index_map->buckets; n++, i = (i + 1) & (index_map->buckets - 1)) {
+		if (entries[i].serial == serial)
+			return &entries[i];
+		if (entries[i].serial == 0)
+			break;
+	}
+
+	return NULL;
+}
+
+/*** ykfde_get_config ***/
+const char * ykfde_get_config(unsigned int serial, const char * device, const char * name) {
+	char confkey[CONFKEYLEN];
+	const char * value;
+
+	if (ykfde_ini == NULL)
+		return NULL;
+
+	/* key section first, then device section, then general */
+	snprintf(confkey, CONFKEYLEN, "%d:%s", serial, name);
+	if ((value = iniparser_getstring(ykfde_ini, confkey, NULL)) != NULL)
+		return value;
+
+	if (device != NULL) {
+		snprintf(confkey, CONFKEYLEN, "%s:%s", device, name);
+		if ((value = iniparser_getstring(ykfde_ini, confkey, NULL)) != NULL)
+			return value;
+	}
+
+	snprintf(confkey, CONFKEYLEN, "general:%s", name);
+	return iniparser_getstring(ykfde_ini, confkey, NULL);
+}
+
+/*** ykfde_path ***/
+const char * ykfde_path(const char * name, const char * path) {
+	const char * value;
+
+	/* not for setuid, and empty is not set */
+	if ((value = secure_getenv(name)) == NULL || *value == 0)
+		return path;
+
+	return value;
+}
+
+/*** ykfde_keyring ***/
+int32_t ykfde_keyring(void) {
+	const char * value;
+
+	/* not for setuid, just like the paths */
+	if ((value = secure_getenv("YKFDE_KEYRING")) != NULL && strcmp(value, "session") == 0)
+		return KEY_SPEC_SESSION_KEYRING;
+
+	return KEY_SPEC_USER_KEYRING;
+}
+
+/*** ykfde_open ***/
+int ykfde_open(struct ykfde_session * session, int index) {
+	memset(session, 0, sizeof(struct ykfde_session));
+	session->luks_slot = -1;
+
+	PROBE1(open__start, index);
+	session->yk = backend->open_key(index);
+	PROBE2(open__done, index, session->yk != NULL);
+
+	if (session->yk == NULL) {
+		if (errno != EAGAIN && errno != ENODEV)
+			perror("open_key() failed");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*** ykfde_identify ***/
+int ykfde_identify(struct ykfde_session * session) {
+	char section_luksslot[10 /* unsigned int in char */ + 1 + sizeof(CONFLUKSSLOT) + 1];
+	const struct index_entry * entry;
+	const char * value;
+	char * name, * saveptr = NULL;
+
+	/* read the serial number from key */
+	if (backend->get_serial(session->yk, &session->serial) == 0) {
+		perror("get_serial() failed");
+		return EXIT_FAILURE;
+	}
+
+	/* use the index if we have one, no config parsing then */
+	if (index_map != NULL) {
+		if ((entry = index_lookup(session->serial)) == NULL) {
+			session->yk_slot = SLOT_CHAL_HMAC2;
+			return EXIT_SUCCESS;
+		}
+		session->yk_slot = entry->yk_slot == 1 ? SLOT_CHAL_HMAC1 : SLOT_CHAL_HMAC2;
+		session->luks_slot = entry->luks_slot;
+		value = *entry->device_names != 0 ? entry->device_names : NULL;
+		goto devices;
+	}
+
+	/* get the yk slot, slot 2 is the default */
+	value = ykfde_get_config(session->serial, NULL, CONFYKSLOT);
+	switch (value != NULL ? strtol(value, NULL, 0) : 0) {
+		case 1:
+		case SLOT_CHAL_HMAC1:
+			session->yk_slot = SLOT_CHAL_HMAC1;
+			break;
+		case 2:
+		case SLOT_CHAL_HMAC2:
+		default:
+			session->yk_slot = SLOT_CHAL_HMAC2;
+			break;
+	}
+
+	/* the luks slot is set for enrolled keys only */
+	if (ykfde_ini != NULL) {
+		sprintf(section_luksslot, "%d:" CONFLUKSSLOT, session->serial);
+		session->luks_slot = iniparser_getint(ykfde_ini, section_luksslot, -1);
+	}
+
+	/* a key can override the list of devices from general section */
+	value = ykfde_get_config(session->serial, NULL, CONFDEVNAME);
+
+devices:
+	if (value == NULL)
+		return EXIT_SUCCESS;
+
+	if ((session->device_names = strdup(value)) == NULL) {
+		perror("strdup() failed");
+		return EXIT_FAILURE;
+	}
+
+	for (name = strtok_r(session->device_names, DEVICES_DELIM, &saveptr); name != NULL;
+			name = strtok_r(NULL, DEVICES_DELIM, &saveptr)) {
+		if (session->devices_count == YKFDE_DEVICES_MAX) {
+			fprintf(stderr, "Too many devices for Yubikey with serial %d, maximum is %d.\n",
+					session->serial, YKFDE_DEVICES_MAX);
+			return EXIT_FAILURE;
+		}
+		session->devices[session->devices_count++] = name;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*** ykfde_close ***/
+void ykfde_close(struct ykfde_session * session) {
+	if (session->yk != NULL && backend->close_key(session->yk) == 0)
+		perror("close_key() failed");
+
+	free(session->device_names);
+	memset(session, 0, sizeof(struct ykfde_session));
+}
+
+/*** ykfde_read_challenge ***/
+int ykfde_read_challenge(unsigned int serial, char * challenge) {
+	int rc = EXIT_FAILURE;
+	char challengefilename[PATH_MAX];
+	int challengefile;
+	const struct index_entry * entry;
+
+	/* the index has all challenges, no need to look for files */
+	if (index_map != NULL) {
+		if ((entry = index_lookup(serial)) == NULL) {
+			errno = ENOENT;
+			return rc;
+		}
+		memcpy(challenge, entry->challenge, YKFDE_CHALLENGELEN);
+		return EXIT_SUCCESS;
+	}
+
+	snprintf(challengefilename, sizeof(challengefilename), "%s/challenge-%d", YKFDE_CHALLENGEDIR, serial);
+
+	/* read challenge from file, a missing file is no error */
+	if ((challengefile = open(challengefilename, O_RDONLY)) < 0) {
+		if (errno != ENOENT)
+			perror("Failed opening challenge file for reading");
+		return rc;
+	}
+
+	if (read(challengefile, challenge, YKFDE_CHALLENGELEN) < 0) {
+		perror("Failed reading challenge from file");
+		goto out;
+	}
+
+	rc = EXIT_SUCCESS;
+
+out:
+	close(challengefile);
+
+	return rc;
+}
+
+/*** ykfde_save_response ***/
+int ykfde_save_response(const struct ykfde_session * session,
+		const char * challenge, const char * passphrase) {
+	int rc = EXIT_FAILURE;
+	char description[sizeof(RESPONSEKEY) + 10 /* unsigned int in char */];
+	uint8_t payload[SHA1_HASHLEN + YKFDE_PASSPHRASELEN];
+	struct sha1 ctx;
+	key_serial_t key;
+
+	snprintf(description, sizeof(description), RESPONSEKEY, session->serial);
+
+	/* bind the response to its challenge, a stale one is never used */
+	sha1_init(&ctx);
+	sha1_update(&ctx, challenge, YKFDE_CHALLENGELEN);
+	sha1_final(&ctx, payload);
+	memcpy(payload + SHA1_HASHLEN, passphrase, YKFDE_PASSPHRASELEN);
+
+	if ((key = add_key("user", description, payload, sizeof(payload), ykfde_keyring())) < 0) {
+		perror("add_key() failed");
+		goto out;
+	}
+
+	/* possessor only, ykfde.service shares the keyring */
+	if (keyctl_setperm(key, KEY_POS_VIEW | KEY_POS_READ | KEY_POS_WRITE |
+			KEY_POS_SEARCH | KEY_POS_SETATTR | KEY_USR_VIEW) < 0) {
+		perror("keyctl_setperm() failed");
+		keyctl_invalidate(key);
+		goto out;
+	}
+
+	if (keyctl_set_timeout(key, RESPONSETIMEOUT) < 0) {
+		perror("keyctl_set_timeout() failed");
+		keyctl_invalidate(key);
+		goto out;
+	}
+
+	rc = EXIT_SUCCESS;
+
+out:
+	memset(payload, 0, sizeof(payload));
+
+	return rc;
+}
+
+/*** ykfde_load_response ***/
+int ykfde_load_response(const struct ykfde_session * session,
+		const char * challenge, char * passphrase) {
+	int rc = EXIT_FAILURE;
+	char description[sizeof(RESPONSEKEY) + 10 /* unsigned int in char */];
+	uint8_t digest[SHA1_HASHLEN];
+	struct sha1 ctx;
+	key_serial_t key;
+	void * payload = NULL;
+	long len;
+
+	snprintf(description, sizeof(description), RESPONSEKEY, session->serial);
+
+	/* a missing key is no error, it timed out or was never there */
+	if ((key = keyctl_search(ykfde_keyring(), "user", description, 0)) < 0)
+		return rc;
+
+	if ((len = keyctl_read_alloc(key, &payload)) < 0) {
+		perror("Failed reading payload from key");
+		return rc;
+	}
+
+	/* the response is used once */
+	keyctl_invalidate(key);
+
+	sha1_init(&ctx);
+	sha1_update(&ctx, challenge, YKFDE_CHALLENGELEN);
+	sha1_final(&ctx, digest);
+
+	if (len != SHA1_HASHLEN + YKFDE_PASSPHRASELEN ||
+			memcmp(payload, digest, SHA1_HASHLEN) != 0) {
+		fprintf(stderr, "Response from boot does not match challenge for Yubikey with serial %d.\n",
+				session->serial);
+		goto out;
+	}
+
+	memcpy(passphrase, (uint8_t *) payload + SHA1_HASHLEN, YKFDE_PASSPHRASELEN);
+
+	rc = EXIT_SUCCESS;
+
+out:
+	memset(payload, 0, len);
+	free(payload);
+
+	return rc;
+}
+
+/*** ykfde_derive_passphrase ***/
+int ykfde_derive_passphrase(const char * passphrase, const char * uuid, char * derived) {
+	uint8_t prk[SHA1_HASHLEN], okm[SHA1_HASHLEN];
+	uint8_t info[sizeof(DERIVEINFO) + UUIDLEN + 1];
+	size_t len;
+
+	if (uuid == NULL || strlen(uuid) > UUIDLEN) {
+		fprintf(stderr, "Invalid UUID to derive passphrase from.\n");
+		return EXIT_FAILURE;
+	}
+
+	/* HKDF (RFC 5869) with HMAC-SHA1, extract... */
+	hmac_sha1((const uint8_t *) DERIVESALT, sizeof(DERIVESALT) - 1,
+			(const uint8_t *) passphrase, YKFDE_PASSPHRASELEN, prk);
+
+	/* ... and expand, a single block is all we need */
+	len = sprintf((char *) info, DERIVEINFO "%s", uuid);
+	info[len++] = 0x01;
+	hmac_sha1(prk, SHA1_HASHLEN, info, len, okm);
+
+	yubikey_hex_encode(derived, (const char *) okm, SHA1_HASHLEN);
+
+	memset(prk, 0, SHA1_HASHLEN);
+	memset(okm, 0, SHA1_HASHLEN);
+
+	return EXIT_SUCCESS;
+}
+
+/*** ykfde_second_factor ***/
+void ykfde_second_factor(char * challenge, const char * second_factor, size_t len) {
+	/* we replace part of the challenge with the second factor */
+	memcpy(challenge, second_factor, len < YKFDE_MAX2FLEN ? len : YKFDE_MAX2FLEN);
+}
+
+/*** ykfde_challenge_response ***/
+int ykfde_challenge_response(struct ykfde_session * session,
+		const char * challenge, char * passphrase) {
+	int rc = EXIT_FAILURE;
+	char response[YKFDE_RESPONSELEN];
+
+	/* do challenge/response and encode to hex */
+	PROBE2(response__start, session->serial, session->yk_slot);
+	if (backend->challenge_response(session->yk, session->yk_slot, true,
+			YKFDE_CHALLENGELEN, (const unsigned char *) challenge,
+			YKFDE_RESPONSELEN, (unsigned char *) response) == 0) {
+		PROBE2(response__done, session->serial, 0);
+		perror("challenge_response() failed");
+		goto out;
+	}
+	PROBE2(response__done, session->serial, 1);
+
+	yubikey_hex_encode(passphrase, response, SHA1_DIGEST_SIZE);
+
+	rc = EXIT_SUCCESS;
+
+out:
+	memset(response, 0, YKFDE_RESPONSELEN);
+
+	return rc;
+}
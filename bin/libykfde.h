@@ -0,0 +1,111 @@
+/*
+ * (C) 2014-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _LIBYKFDE_H
+#define _LIBYKFDE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <iniparser/iniparser.h>
+
+#include <ykpers-1/ykdef.h>
+
+#include "backend.h"
+
+/* Yubikey supports write of 64 byte challenge to slot,
+ * returns HMAC-SHA1 response.
+ *
+ * Lengths are defined in ykpers-1/ykdef.h:
+ * SHA1_MAX_BLOCK_SIZE     64
+ * SHA1_DIGEST_SIZE        20
+ *
+ * For passphrase we use hex encoded digest, that is
+ * twice the length of binary digest. */
+#define YKFDE_CHALLENGELEN	SHA1_MAX_BLOCK_SIZE
+#define YKFDE_RESPONSELEN	SHA1_MAX_BLOCK_SIZE
+#define YKFDE_PASSPHRASELEN	SHA1_DIGEST_SIZE * 2
+/* the second factor replaces up to half of the challenge */
+#define YKFDE_MAX2FLEN		YKFDE_CHALLENGELEN / 2
+
+/* maximum number of devices per key */
+#define YKFDE_DEVICES_MAX	8
+
+/* An open Yubikey with everything we know about it. The handle is
+ * opened once, serial and per serial config are read once. */
+struct ykfde_session {
+	BACKEND_KEY * yk;
+	unsigned int serial;
+	uint8_t yk_slot;
+	int luks_slot;
+	char * device_names;
+	const char * devices[YKFDE_DEVICES_MAX];
+	unsigned int devices_count;
+};
+
+/* The library is built with hidden visibility, only what is declared
+ * here is exported. The token plugin loads it into systemd-cryptsetup
+ * and cryptsetup, our helpers must not clash with their symbols. */
+#define YKFDE_EXPORT	__attribute__ ((visibility ("default")))
+
+/* Paths from config.h, overridden from environment if set. This
+ * lets everything run outside of initramfs, on files of its own. */
+#define YKFDE_CONFIGFILE	ykfde_path("YKFDE_CONFIGFILE", CONFIGFILE)
+#define YKFDE_CHALLENGEDIR	ykfde_path("YKFDE_CHALLENGEDIR", CHALLENGEDIR)
+#define YKFDE_CPIOFILE		ykfde_path("YKFDE_CPIOFILE", CPIOFILE)
+#define YKFDE_INDEXFILE		ykfde_path("YKFDE_INDEXFILE", INDEXFILE)
+
+YKFDE_EXPORT const char * ykfde_path(const char * name, const char * path);
+/* Keyring for second factor and response, the user keyring. With
+ * YKFDE_KEYRING=session in environment the session keyring, which
+ * keeps tests apart from each other and from the system. */
+YKFDE_EXPORT int32_t ykfde_keyring(void);
+
+/* The functions return EXIT_SUCCESS or EXIT_FAILURE. ykfde_open()
+ * fails with errno set to ENODEV if there is no key with given index. */
+YKFDE_EXPORT int ykfde_init(dictionary * ini);
+YKFDE_EXPORT void ykfde_release(void);
+
+YKFDE_EXPORT int ykfde_open(struct ykfde_session * session, int index);
+YKFDE_EXPORT int ykfde_identify(struct ykfde_session * session);
+YKFDE_EXPORT void ykfde_close(struct ykfde_session * session);
+
+/* The binary index written by ykfde-cpio replaces config and
+ * challenge files for ykfde_identify() and ykfde_read_challenge().
+ * Flags from the index header are returned, see index.h. */
+YKFDE_EXPORT int ykfde_index_open(const char * path, uint32_t * flags);
+YKFDE_EXPORT void ykfde_index_close(void);
+
+YKFDE_EXPORT const char * ykfde_get_config(unsigned int serial, const char * device, const char * name);
+YKFDE_EXPORT int ykfde_read_challenge(unsigned int serial, char * challenge);
+/* The response from boot is left in keyring, bound to the
+ * challenge it was made for. Loading it removes it from keyring. */
+YKFDE_EXPORT int ykfde_save_response(const struct ykfde_session * session,
+		const char * challenge, const char * passphrase);
+YKFDE_EXPORT int ykfde_load_response(const struct ykfde_session * session,
+		const char * challenge, char * passphrase);
+
+/* Derive the passphrase for a LUKS device with given UUID from
+ * the response, so a single response unlocks several devices. */
+YKFDE_EXPORT int ykfde_derive_passphrase(const char * passphrase, const char * uuid, char * derived);
+
+YKFDE_EXPORT void ykfde_second_factor(char * challenge, const char * second_factor, size_t len);
+YKFDE_EXPORT int ykfde_challenge_response(struct ykfde_session * session,
+		const char * challenge, char * passphrase);
+
+#endif /* _LIBYKFDE_H */
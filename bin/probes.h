@@ -0,0 +1,42 @@
+/*
+ * (C) 2014-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _PROBES_H
+#define _PROBES_H
+
+/* USDT static tracepoints in provider 'ykfde', for example:
+ *
+ * bpftrace -e 'usdt:/usr/lib/libykfde.so.0:ykfde:response__done { ... }'
+ *
+ * Probes open__* and response__* live in the library, the others in
+ * the binary that fires them (/usr/lib/ykfde/worker, ykfde, ...).
+ *
+ * A disabled probe is a single nop instruction. Never pass
+ * challenges, responses, passphrases or second factors! */
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define PROBE(name)		DTRACE_PROBE(ykfde, name)
+#define PROBE1(name, a)		DTRACE_PROBE1(ykfde, name, a)
+#define PROBE2(name, a, b)	DTRACE_PROBE2(ykfde, name, a, b)
+#else
+#define PROBE(name)		do { } while (0)
+#define PROBE1(name, a)		do { } while (0)
+#define PROBE2(name, a, b)	do { } while (0)
+#endif
+
+#endif /* _PROBES_H */
@@ -0,0 +1,164 @@
+/*
+ * (C) 2014-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <string.h>
+
+#include "sha1.h"
+
+#define ROL(value, bits)	(((value) << (bits)) | ((value) >> (32 - (bits))))
+
+/*** sha1_transform ***/
+static void sha1_transform(uint32_t * state, const uint8_t * block) {
+	uint32_t w[80], a, b, c, d, e, f, k, tmp;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t) block[i * 4] << 24 | (uint32_t) block[i * 4 + 1] << 16 |
+			(uint32_t) block[i * 4 + 2] << 8 | (uint32_t) block[i * 4 + 3];
+	for (; i < 80; i++)
+		w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+
+	for (i = 0; i < 80; i++) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+
+		tmp = ROL(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = ROL(b, 30);
+		b = a;
+		a = tmp;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+
+	memset(w, 0, sizeof(w));
+}
+
+/*** sha1_init ***/
+void sha1_init(struct sha1 * ctx) {
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xefcdab89;
+	ctx->state[2] = 0x98badcfe;
+	ctx->state[3] = 0x10325476;
+	ctx->state[4] = 0xc3d2e1f0;
+	ctx->length = 0;
+	ctx->fill = 0;
+}
+
+/*** sha1_update ***/
+void sha1_update(struct sha1 * ctx, const void * data, size_t len) {
+	const uint8_t * ptr = data;
+	size_t chunk;
+
+	ctx->length += len;
+
+	while (len > 0) {
+		chunk = SHA1_BLOCKLEN - ctx->fill;
+		if (chunk > len)
+			chunk = len;
+
+		memcpy(ctx->buffer + ctx->fill, ptr, chunk);
+		ctx->fill += chunk;
+		ptr += chunk;
+		len -= chunk;
+
+		if (ctx->fill == SHA1_BLOCKLEN) {
+			sha1_transform(ctx->state, ctx->buffer);
+			ctx->fill = 0;
+		}
+	}
+}
+
+/*** sha1_final ***/
+void sha1_final(struct sha1 * ctx, uint8_t * digest) {
+	uint64_t bits = ctx->length * 8;
+	int i;
+
+	ctx->buffer[ctx->fill++] = 0x80;
+	if (ctx->fill > SHA1_BLOCKLEN - 8) {
+		memset(ctx->buffer + ctx->fill, 0, SHA1_BLOCKLEN - ctx->fill);
+		sha1_transform(ctx->state, ctx->buffer);
+		ctx->fill = 0;
+	}
+	memset(ctx->buffer + ctx->fill, 0, SHA1_BLOCKLEN - 8 - ctx->fill);
+	for (i = 0; i < 8; i++)
+		ctx->buffer[SHA1_BLOCKLEN - 1 - i] = bits >> (i * 8);
+	sha1_transform(ctx->state, ctx->buffer);
+
+	for (i = 0; i < SHA1_HASHLEN; i++)
+		digest[i] = ctx->state[i / 4] >> (24 - (i % 4) * 8);
+
+	memset(ctx, 0, sizeof(struct sha1));
+}
+
+/*** hmac_sha1 ***/
+void hmac_sha1(const uint8_t * key, size_t key_len,
+		const uint8_t * data, size_t data_len, uint8_t * digest) {
+	struct sha1 ctx;
+	uint8_t pad[SHA1_BLOCKLEN], inner[SHA1_HASHLEN];
+	int i;
+
+	memset(pad, 0, SHA1_BLOCKLEN);
+
+	/* keys longer than block size are hashed first */
+	if (key_len > SHA1_BLOCKLEN) {
+		sha1_init(&ctx);
+		sha1_update(&ctx, key, key_len);
+		sha1_final(&ctx, pad);
+	} else
+		memcpy(pad, key, key_len);
+
+	for (i = 0; i < SHA1_BLOCKLEN; i++)
+		pad[i] ^= 0x36;
+	sha1_init(&ctx);
+	sha1_update(&ctx, pad, SHA1_BLOCKLEN);
+	sha1_update(&ctx, data, data_len);
+	sha1_final(&ctx, inner);
+
+	for (i = 0; i < SHA1_BLOCKLEN; i++)
+		pad[i] ^= 0x36 ^ 0x5c;
+	sha1_init(&ctx);
+	sha1_update(&ctx, pad, SHA1_BLOCKLEN);
+	sha1_update(&ctx, inner, SHA1_HASHLEN);
+	sha1_final(&ctx, digest);
+
+	memset(pad, 0, SHA1_BLOCKLEN);
+	memset(inner, 0, SHA1_HASHLEN);
+}
@@ -0,0 +1,42 @@
+/*
+ * (C) 2014-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _SHA1_H
+#define _SHA1_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA1_BLOCKLEN	64
+#define SHA1_HASHLEN	20
+
+struct sha1 {
+	uint32_t state[5];
+	uint64_t length;
+	uint8_t buffer[SHA1_BLOCKLEN];
+	size_t fill;
+};
+
+void sha1_init(struct sha1 * ctx);
+void sha1_update(struct sha1 * ctx, const void * data, size_t len);
+void sha1_final(struct sha1 * ctx, uint8_t * digest);
+
+void hmac_sha1(const uint8_t * key, size_t key_len,
+		const uint8_t * data, size_t data_len, uint8_t * digest);
+
+#endif /* _SHA1_H */
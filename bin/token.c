@@ -0,0 +1,260 @@
+/*
+ * (C) 2014-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This is an external token handler for libcryptsetup. It unlocks a
+ * LUKS2 keyslot with the challenge-response of the Yubikey referenced
+ * by a token of type 'ykfde', in process of systemd-cryptsetup or
+ * 'cryptsetup open --token-only'.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iniparser/iniparser.h>
+
+#include <json-c/json.h>
+
+#include <libcryptsetup.h>
+
+#include "../config.h"
+#include "../version.h"
+#include "libykfde.h"
+#include "token.h"
+
+#define CHALLENGELEN	YKFDE_CHALLENGELEN
+#define PASSPHRASELEN	YKFDE_PASSPHRASELEN
+
+/* maximum number of Yubikeys probed for the serial */
+#define YK_MAX		8
+
+/* what a token references */
+struct token {
+	unsigned int serial;
+	uint8_t yk_slot;
+	bool second_factor;
+	bool derived;
+};
+
+/*** parse_token ***/
+static int parse_token(const char * json, struct token * token) {
+	int rc = -EINVAL;
+	json_object * root, * obj;
+	int64_t value;
+
+	if ((root = json_tokener_parse(json)) == NULL)
+		return rc;
+
+	if (json_object_object_get_ex(root, TOKENSERIAL, &obj) == 0 ||
+			json_object_is_type(obj, json_type_int) == 0 ||
+			(value = json_object_get_int64(obj)) <= 0 || value > UINT32_MAX)
+		goto out;
+	token->serial = value;
+
+	token->yk_slot = SLOT_CHAL_HMAC2;
+	if (json_object_object_get_ex(root, TOKENYKSLOT, &obj) != 0) {
+		if (json_object_is_type(obj, json_type_int) == 0)
+			goto out;
+		switch (json_object_get_int64(obj)) {
+			case 1:
+			case SLOT_CHAL_HMAC1:
+				token->yk_slot = SLOT_CHAL_HMAC1;
+				break;
+			case 2:
+			case SLOT_CHAL_HMAC2:
+				token->yk_slot = SLOT_CHAL_HMAC2;
+				break;
+			default:
+				goto out;
+		}
+	}
+
+	token->second_factor = false;
+	if (json_object_object_get_ex(root, TOKEN2NDFACTOR, &obj) != 0) {
+		if (json_object_is_type(obj, json_type_boolean) == 0)
+			goto out;
+		token->second_factor = json_object_get_boolean(obj);
+	}
+
+	token->derived = false;
+	if (json_object_object_get_ex(root, TOKENDERIVED, &obj) != 0) {
+		if (json_object_is_type(obj, json_type_boolean) == 0)
+			goto out;
+		token->derived = json_object_get_boolean(obj);
+	}
+
+	rc = 0;
+
+out:
+	json_object_put(root);
+
+	return rc;
+}
+
+/*** get_response ***/
+static int get_response(struct crypt_device * cd, const struct token * token,
+		const char * challenge, char * passphrase) {
+	int rc = -EAGAIN, i;
+	struct ykfde_session session;
+	dictionary * ini;
+
+	/* the config file selects the backend, defaults are fine */
+	ini = iniparser_load(YKFDE_CONFIGFILE);
+
+	if (ykfde_init(ini) != EXIT_SUCCESS) {
+		rc = -EINVAL;
+		goto out10;
+	}
+
+	/* find the Yubikey with the serial from token */
+	for (i = 0; i < YK_MAX; i++) {
+		if (ykfde_open(&session, i) != EXIT_SUCCESS)
+			break;
+		if (ykfde_identify(&session) == EXIT_SUCCESS && session.serial == token->serial)
+			break;
+		ykfde_close(&session);
+	}
+
+	if (session.yk == NULL) {
+		crypt_logf(cd, CRYPT_LOG_VERBOSE, "Yubikey with serial %d is not available.\n", token->serial);
+		goto out20;
+	}
+
+	/* the token knows the slot, config may be missing */
+	session.yk_slot = token->yk_slot;
+	if (ykfde_challenge_response(&session, challenge, passphrase) != EXIT_SUCCESS) {
+		crypt_logf(cd, CRYPT_LOG_ERROR, "Challenge-response with Yubikey %d failed.\n", token->serial);
+		goto out30;
+	}
+
+	rc = 0;
+
+out30:
+	ykfde_close(&session);
+
+out20:
+	ykfde_release();
+
+out10:
+	if (ini != NULL)
+		iniparser_freedict(ini);
+
+	return rc;
+}
+
+/*** cryptsetup_token_open_pin ***/
+int cryptsetup_token_open_pin(struct crypt_device * cd, int token_id, const char * pin,
+		size_t pin_size, char ** buffer, size_t * buffer_len, void * usrptr) {
+	int rc;
+	const char * json;
+	struct token token;
+	char challenge[CHALLENGELEN + 1], response[PASSPHRASELEN + 1], * passphrase;
+
+	if ((rc = crypt_token_json_get(cd, token_id, &json)) < 0)
+		return rc;
+
+	if ((rc = parse_token(json, &token)) < 0)
+		return rc;
+
+	/* the second factor is given as pin */
+	if (token.second_factor == true && pin == NULL)
+		return -ENOANO;
+
+	memset(challenge, 0, CHALLENGELEN + 1);
+	if (ykfde_read_challenge(token.serial, challenge) != EXIT_SUCCESS) {
+		crypt_logf(cd, CRYPT_LOG_ERROR, "Failed reading challenge for Yubikey %d.\n", token.serial);
+		rc = -ENOENT;
+		goto out;
+	}
+
+	/* we replace part of the challenge with the second factor */
+	if (pin != NULL)
+		ykfde_second_factor(challenge, pin, pin_size);
+
+	if ((passphrase = crypt_safe_alloc(PASSPHRASELEN + 1)) == NULL) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	if ((rc = get_response(cd, &token, challenge, response)) < 0) {
+		crypt_safe_free(passphrase);
+		goto out;
+	}
+
+	/* the passphrase of this device is derived from response */
+	if (token.derived == false)
+		memcpy(passphrase, response, PASSPHRASELEN);
+	else if (ykfde_derive_passphrase(response, crypt_get_uuid(cd), passphrase) != EXIT_SUCCESS) {
+		crypt_safe_free(passphrase);
+		rc = -EINVAL;
+		goto out;
+	}
+
+	*buffer = passphrase;
+	*buffer_len = PASSPHRASELEN;
+
+out:
+	memset(challenge, 0, CHALLENGELEN + 1);
+	memset(response, 0, PASSPHRASELEN + 1);
+
+	return rc;
+}
+
+/*** cryptsetup_token_open ***/
+int cryptsetup_token_open(struct crypt_device * cd, int token_id,
+		char ** buffer, size_t * buffer_len, void * usrptr) {
+	return cryptsetup_token_open_pin(cd, token_id, NULL, 0, buffer, buffer_len, usrptr);
+}
+
+/*** cryptsetup_token_buffer_free ***/
+void cryptsetup_token_buffer_free(void * buffer, size_t buffer_len) {
+	crypt_safe_free(buffer);
+}
+
+/*** cryptsetup_token_validate ***/
+int cryptsetup_token_validate(struct crypt_device * cd, const char * json) {
+	struct token token;
+
+	if (parse_token(json, &token) < 0) {
+		crypt_log(cd, CRYPT_LOG_ERROR, "Token of type " TOKENTYPE " is invalid.\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*** cryptsetup_token_dump ***/
+void cryptsetup_token_dump(struct crypt_device * cd, const char * json) {
+	struct token token;
+
+	if (parse_token(json, &token) < 0)
+		return;
+
+	crypt_logf(cd, CRYPT_LOG_NORMAL, "\tYubikey serial: %d\n", token.serial);
+	crypt_logf(cd, CRYPT_LOG_NORMAL, "\tYubikey slot:   %d\n",
+			token.yk_slot == SLOT_CHAL_HMAC1 ? 1 : 2);
+	crypt_logf(cd, CRYPT_LOG_NORMAL, "\tSecond factor:  %s\n",
+			token.second_factor == true ? "yes" : "no");
+	crypt_logf(cd, CRYPT_LOG_NORMAL, "\tDerived:        %s\n",
+			token.derived == true ? "yes" : "no");
+}
+
+/*** cryptsetup_token_version ***/
+const char * cryptsetup_token_version(void) {
+	return VERSION;
+}
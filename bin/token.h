@@ -0,0 +1,35 @@
+/*
+ * (C) 2014-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TOKEN_H
+#define _TOKEN_H
+
+/* LUKS2 token written by ykfde and read by libcryptsetup-token-ykfde.so,
+ * the type has to match the name of the library */
+#define TOKENTYPE	"ykfde"
+#define TOKENSERIAL	"ykfde-serial"
+#define TOKENYKSLOT	"ykfde-yk-slot"
+#define TOKEN2NDFACTOR	"ykfde-2nd-factor"
+#define TOKENDERIVED	"ykfde-derived"
+
+/* format for key slot, serial, yk slot, second factor and derived passphrase */
+#define TOKENJSON	"{ \"type\": \"" TOKENTYPE "\", \"keyslots\": [ \"%d\" ], " \
+			"\"" TOKENSERIAL "\": %u, \"" TOKENYKSLOT "\": %d, " \
+			"\"" TOKEN2NDFACTOR "\": %s, \"" TOKENDERIVED "\": %s }"
+
+#endif /* _TOKEN_H */
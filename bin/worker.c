@@ -16,48 +16,303 @@
  *
  */
 
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/poll.h>
+#include <sys/random.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <sys/un.h>
 #include <unistd.h>
 
 #include <systemd/sd-daemon.h>
+#include <systemd/sd-journal.h>
 
 #include <iniparser/iniparser.h>
 
 #include <keyutils.h>
 
-#include <yubikey.h>
-#include <ykpers-1/ykdef.h>
-#include <ykpers-1/ykcore.h>
+#include <libudev.h>
+
+#include <libcryptsetup.h>
 
 #include "../config.h"
+#include "index.h"
+#include "libykfde.h"
+#include "probes.h"
+#include "token.h"
 
-/* Yubikey supports write of 64 byte challenge to slot,
- * returns HMAC-SHA1 response.
- *
- * Lengths are defined in ykpers-1/ykdef.h:
- * SHA1_MAX_BLOCK_SIZE     64
- * SHA1_DIGEST_SIZE        20
- *
- * For passphrase we use hex encoded digest, that is
- * twice the length of binary digest. */
-#define CHALLENGELEN	SHA1_MAX_BLOCK_SIZE
-#define RESPONSELEN	SHA1_MAX_BLOCK_SIZE
-#define PASSPHRASELEN	SHA1_DIGEST_SIZE * 2
+#define CHALLENGELEN	YKFDE_CHALLENGELEN
+#define PASSPHRASELEN	YKFDE_PASSPHRASELEN
 
 #define ASK_PATH	"/run/systemd/ask-password/"
-#define ASK_MESSAGE	"Please enter passphrase for disk"
+/* systemd-cryptsetup asks with id of (escaped) source device,
+ * the message may be localized */
+#define ASK_ID		"cryptsetup:"
+/* ask files are small, anything larger is not for us */
+#define ASK_FILE_MAX	4096
+/* number of answered requests we remember, a request is
+ * never answered twice to not waste its tries */
+#define ASK_ANSWERED	16
+
+/* USB vendor id of Yubico, as seen by udev */
+#define YUBICO_VENDOR	"1050"
+
+/* interval to check for second factor in key store, and how long
+ * to wait for it on boot - later it is checked for from main loop */
+#define SECOND_FACTOR_POLL	10 /* milliseconds */
+#define SECOND_FACTOR_TIMEOUT	60 /* seconds */
+#define SECOND_FACTOR_RECHECK	1000 /* milliseconds */
+
+/* Retries of busy Yubikeys start with this delay, it doubles up to
+ * the maximum. The deadline is 'retry deadline' from config. */
+#define RETRY_DELAY_MIN	20 /* milliseconds */
+#define RETRY_DELAY_MAX	500 /* milliseconds */
+
+/* maximum number of Yubikeys handled at a time */
+#define YK_MAX		8
+
+/* delimiters for fields and options in crypttab */
+#define CRYPTTAB_DELIM	" \t\n"
+#define OPTIONS_DELIM	","
+
+/* timings are written here, /run survives switch-root */
+#define TIMINGS_PATH	"/run/ykfde"
+#define TIMINGS_FILE	"timings.json"
+
+const static char optstring[] = "hr";
+const static struct option options_long[] = {
+	/* name			has_arg			flag	val */
+	{ "help",		no_argument,		NULL,	'h' },
+	{ "resident",		no_argument,		NULL,	'r' },
+	{ 0, 0, 0, 0 }
+};
+
+static char * ask_answered[ASK_ANSWERED];
+static unsigned int ask_answered_count = 0;
+
+/* the source devices of the key that unlocked, requests
+ * for other devices are not answered */
+static char * ask_sources[YKFDE_DEVICES_MAX];
+static unsigned int ask_sources_count = 0;
+
+/* directory with requests, from environment or ASK_PATH */
+static const char * ask_path = ASK_PATH;
+/* where timings go and crypttab, from environment or defaults */
+static const char * timings_path = TIMINGS_PATH;
+static const char * crypttab_path = CRYPTTAB;
+/* keyring for second factor and passphrase, session for testing */
+static key_serial_t keyring = KEY_SPEC_USER_KEYRING;
+
+/* socket to answer requests, opened once */
+static int fd_askpass = -1;
+
+/* what we need from an ask file */
+struct ask {
+	char id[PATH_MAX];
+	char socket[sizeof(((struct sockaddr_un *) NULL)->sun_path)];
+	uint64_t not_after;
+};
+
+/* phases of an unlock we take the time for */
+enum phase {
+	PHASE_INIT = 0,
+	PHASE_OPEN,
+	PHASE_SERIAL,
+	PHASE_CHALLENGE,
+	PHASE_2NDFACTOR,
+	PHASE_RESPONSE,
+	PHASE_KEYRING,
+	PHASE_ASKPASS,
+	PHASE_ACTIVATE,
+	PHASE_MAX
+};
+
+static const char * phase_names[PHASE_MAX] = {
+	[PHASE_INIT]		= "init",
+	[PHASE_OPEN]		= "open",
+	[PHASE_SERIAL]		= "serial",
+	[PHASE_CHALLENGE]	= "challenge",
+	[PHASE_2NDFACTOR]	= "second_factor",
+	[PHASE_RESPONSE]	= "response",
+	[PHASE_KEYRING]		= "keyring",
+	[PHASE_ASKPASS]		= "askpass",
+	[PHASE_ACTIVATE]	= "activate",
+};
+
+/* microseconds spent in each phase */
+static uint64_t timings[PHASE_MAX];
+static uint64_t timings_start;
+
+/* general settings, from index or config file */
+static uint32_t conf_flags = 0;
+
+/* milliseconds to retry Yubikeys that are busy */
+static unsigned int retry_deadline = RETRYDEADLINE;
+
+/* the second factor is asked for once on boot, so wait for it once */
+static bool second_factor_waited = false;
+
+/* every Yubikey with a challenge gets its own thread */
+struct key {
+	struct ykfde_session session;
+	/* the thread is in challenge-response, an orphan
+	 * is left to it when another key won */
+	bool running;
+	bool orphan;
+	pthread_t thread;
+	char challenge[CHALLENGELEN + 1];
+};
+
+static struct key * keys[YK_MAX];
+static unsigned int keys_count = 0;
+
+/* shared between the challenge-response threads, first response wins */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned int running;
+	/* threads of slower Yubikeys, still waiting for touch */
+	unsigned int orphans;
+	uint8_t done;
+	/* a failed Yubikey may succeed when retried */
+	bool transient;
+	struct key * key;
+	/* key slot of the winner, still needed when keys are closed */
+	int luks_slot;
+	char * passphrase;
+} winner = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/*** now_usec ***/
+static uint64_t now_usec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*** transient ***/
+static bool transient(int error) {
+	/* the key is busy, or not ready yet after it was plugged -
+	 * anything else does not get better with time */
+	switch (error) {
+		case EAGAIN:
+		case EBUSY:
+		case EIO:
+		case ETIMEDOUT:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*** stopping ***/
+static bool stopping(void) {
+	sigset_t pending;
+
+	/* signals are blocked in resident mode, give up when stopped */
+	return sigpending(&pending) == 0 &&
+		(sigismember(&pending, SIGTERM) == 1 || sigismember(&pending, SIGINT) == 1);
+}
+
+/*** write_timings ***/
+static int write_timings(void) {
+	int rc = EXIT_FAILURE;
+	FILE * timingsfile;
+	char timingsfilename[PATH_MAX], timingsfiletmpname[PATH_MAX];
+	int fd, i;
+
+	if (snprintf(timingsfilename, sizeof(timingsfilename), "%s/" TIMINGS_FILE,
+				timings_path) >= sizeof(timingsfilename) ||
+			snprintf(timingsfiletmpname, sizeof(timingsfiletmpname), "%s/" TIMINGS_FILE "-XXXXXX",
+				timings_path) >= sizeof(timingsfiletmpname)) {
+		fprintf(stderr, "Path %s is too long.\n", timings_path);
+		goto out10;
+	}
+
+	if (mkdir(timings_path, 0755) < 0 && errno != EEXIST) {
+		perror("mkdir() failed");
+		goto out10;
+	}
+
+	if ((fd = mkstemp(timingsfiletmpname)) < 0) {
+		perror("mkstemp() failed");
+		goto out10;
+	}
+
+	if ((timingsfile = fdopen(fd, "w")) == NULL) {
+		perror("fdopen() failed");
+		close(fd);
+		goto out20;
+	}
+
+	fprintf(timingsfile, "{\n\t\"serial\": %u,\n", winner.key->session.serial);
+	for (i = 0; i < PHASE_MAX; i++)
+		fprintf(timingsfile, "\t\"%s_usec\": %" PRIu64 ",\n", phase_names[i], timings[i]);
+	fprintf(timingsfile, "\t\"total_usec\": %" PRIu64 "\n}\n", now_usec() - timings_start);
+
+	if (fchmod(fd, 0644) < 0 || fclose(timingsfile) != 0) {
+		perror("Failed writing timings");
+		goto out20;
+	}
+
+	if (rename(timingsfiletmpname, timingsfilename) < 0) {
+		perror("rename() failed");
+		goto out20;
+	}
+
+	rc = EXIT_SUCCESS;
+
+out20:
+	if (rc != EXIT_SUCCESS)
+		unlink(timingsfiletmpname);
+
+out10:
+	return rc;
+}
+
+/*** report_timings ***/
+static void report_timings(void) {
+	uint64_t total = now_usec() - timings_start;
+
+	sd_journal_send("MESSAGE=Unlocked with Yubikey %u in %" PRIu64 " ms.", winner.key->session.serial, total / 1000,
+			"PRIORITY=6",
+			"YKFDE_SERIAL=%u", winner.key->session.serial,
+			"YKFDE_INIT_USEC=%" PRIu64, timings[PHASE_INIT],
+			"YKFDE_OPEN_USEC=%" PRIu64, timings[PHASE_OPEN],
+			"YKFDE_SERIAL_USEC=%" PRIu64, timings[PHASE_SERIAL],
+			"YKFDE_CHALLENGE_USEC=%" PRIu64, timings[PHASE_CHALLENGE],
+			"YKFDE_SECOND_FACTOR_USEC=%" PRIu64, timings[PHASE_2NDFACTOR],
+			"YKFDE_RESPONSE_USEC=%" PRIu64, timings[PHASE_RESPONSE],
+			"YKFDE_KEYRING_USEC=%" PRIu64, timings[PHASE_KEYRING],
+			"YKFDE_ASKPASS_USEC=%" PRIu64, timings[PHASE_ASKPASS],
+			"YKFDE_ACTIVATE_USEC=%" PRIu64, timings[PHASE_ACTIVATE],
+			"YKFDE_TOTAL_USEC=%" PRIu64, total,
+			NULL);
+
+	write_timings();
+}
 
 /*** send_on_socket ***/
 static int send_on_socket(int fd, const char *socket_name, const void *packet, size_t size) {
@@ -78,71 +333,94 @@ static int send_on_socket(int fd, const char *socket_name, const void *packet, s
 	return EXIT_SUCCESS;
 }
 
-/*** yk_open_and_check ***/
-static YK_KEY * yk_open_and_check(const unsigned int expected, unsigned int * serial) {
-	YK_KEY * yk;
+/*** open_keys ***/
+static unsigned int open_keys(bool * retry) {
+	struct key * key;
+	uint64_t start;
+	int i, rc;
 
-	if ((yk = yk_open_first_key()) == NULL) {
-		if (errno != EAGAIN)
-			perror("yk_open_first_key() failed");
-		goto out1;
-	}
+	keys_count = 0;
+	*retry = false;
 
-	if (serial != NULL) {
-		/* read the serial number from key */
-		if (yk_get_serial(yk, 0, 0, serial) == 0) {
-			perror("yk_get_serial() failed");
-			goto out2;
+	for (i = 0; i < YK_MAX; i++) {
+		if ((key = calloc(1, sizeof(struct key))) == NULL) {
+			perror("calloc() failed");
+			break;
 		}
 
-		if (expected > 0 && expected != *serial) {
-			fprintf(stderr, "Opened Yubikey with unexpected serial number (%d != %d)...\n", expected, *serial);
-			goto out2;
+		start = now_usec();
+		rc = ykfde_open(&key->session, i);
+		timings[PHASE_OPEN] += now_usec() - start;
+		if (rc != EXIT_SUCCESS) {
+			if (errno == ENODEV) {
+				free(key);
+				break;
+			}
+			/* a busy key does not hide the ones after it */
+			if (transient(errno) == true)
+				*retry = true;
+			free(key);
+			continue;
 		}
-	}
-
-	return yk;
-
-out2:
-	/* close Yubikey */
-	if (yk_close_key(yk) == 0)
-		perror("yk_close_key() failed");
 
-out1:
-	return NULL;
-}
+		/* read the serial number and config for key */
+		start = now_usec();
+		rc = ykfde_identify(&key->session);
+		timings[PHASE_SERIAL] += now_usec() - start;
+		if (rc != EXIT_SUCCESS) {
+			if (transient(errno) == true)
+				*retry = true;
+			goto close;
+		}
 
-/*** read_challenge ***/
-static int read_challenge(const unsigned int serial, char * challenge) {
-	int rc = EXIT_FAILURE;
-	char challengefilename[sizeof(CHALLENGEDIR) + 11 /* "/challenge-" */ + 10 /* unsigned int in char */ + 1];
-	int challengefile;
+		/* skip keys that are not enrolled, retry does not help */
+		start = now_usec();
+		rc = ykfde_read_challenge(key->session.serial, key->challenge);
+		timings[PHASE_CHALLENGE] += now_usec() - start;
+		if (rc != EXIT_SUCCESS)
+			goto close;
 
-	snprintf(challengefilename, sizeof(challengefilename), CHALLENGEDIR "/challenge-%d", serial);
+		keys[keys_count++] = key;
+		continue;
 
-	/* check if challenge file exists */
-	if (access(challengefilename, R_OK) == -1) {
-		goto out1;
+close:
+		ykfde_close(&key->session);
+		free(key);
 	}
 
-	/* read challenge from file */
-	if ((challengefile = open(challengefilename, O_RDONLY)) < 0) {
-		perror("Failed opening challenge file for reading");
-		goto out1;
-	}
+	return keys_count;
+}
 
-	if (read(challengefile, challenge, CHALLENGELEN) < 0) {
-		perror("Failed reading challenge from file");
-		goto out2;
-	}
+/*** free_key ***/
+static void free_key(struct key * key) {
+	/* close Yubikey */
+	ykfde_close(&key->session);
 
-	rc = EXIT_SUCCESS;
+	memset(key->challenge, 0, CHALLENGELEN + 1);
+	free(key);
+}
 
-out2:
-	close(challengefile);
+/*** close_keys ***/
+static void close_keys(void) {
+	struct key * key;
+
+	pthread_mutex_lock(&winner.mutex);
+	while (keys_count > 0) {
+		key = keys[--keys_count];
+		keys[keys_count] = NULL;
+
+		/* A slower Yubikey may wait for touch until it times out,
+		 * do not wait for it. Its thread closes it when done. */
+		if (key->running == true) {
+			key->orphan = true;
+			winner.orphans++;
+			continue;
+		}
 
-out1:
-	return rc;
+		free_key(key);
+	}
+	winner.key = NULL;
+	pthread_mutex_unlock(&winner.mutex);
 }
 
 /*** get_second_factor ***/
@@ -153,7 +431,7 @@ static char * get_second_factor(void) {
 	/* get second factor from key store
 	 * If this fails it is not critical... possibly we just do not
 	 * use second factor. */
-	key = keyctl_search(KEY_SPEC_USER_KEYRING, "user", "ykfde-2f", 0);
+	key = keyctl_search(keyring, "user", "ykfde-2f", 0);
 
 	if (key > 0) {
 		/* if we have a key id we have a key - so this should succeed */
@@ -168,78 +446,79 @@ static char * get_second_factor(void) {
 	return NULL;
 }
 
-/*** get_response ***/
-static int get_response(const unsigned int serial, uint8_t slot, char * challenge, char * passphrase) {
-	YK_KEY * yk;
-	char response[RESPONSELEN];
+/*** has_second_factor ***/
+static bool has_second_factor(void) {
+	return keyctl_search(keyring, "user", "ykfde-2f", 0) > 0;
+}
+
+/*** wait_second_factor ***/
+static char * wait_second_factor(void) {
+	const struct timespec poll = { .tv_sec = 0, .tv_nsec = SECOND_FACTOR_POLL * 1000000 };
+	uint64_t deadline = now_usec() + SECOND_FACTOR_TIMEOUT * 1000000ULL;
 	char * second_factor;
-	size_t second_factor_len;
-	/* iniparser */
-	dictionary * ini;
-	char section_ykslot[10 /* unsigned int in char */ + 1 + sizeof(CONFYKSLOT) + 1];
 
-	memset(response, 0, RESPONSELEN);
+	/* systemd-ask-password adds the key when the user is done,
+	 * we have no notification - so poll, but not forever */
+	while ((second_factor = get_second_factor()) == NULL) {
+		if (stopping() == true || now_usec() > deadline)
+			return NULL;
 
-	if ((second_factor = get_second_factor()) != NULL) {
-		/* we replace part of the challenge with the second factor */
-		second_factor_len = strlen(second_factor);
-		memcpy(challenge, second_factor, second_factor_len < CHALLENGELEN / 2 ?
-				second_factor_len : CHALLENGELEN / 2);
-		memset(second_factor, 0, second_factor_len);
-		free(second_factor);
+		nanosleep(&poll, NULL);
 	}
 
-	/* try to read config file
-	 * If anything here fails we do not care... slot 2 is the default. */
-	if ((ini = iniparser_load(CONFIGFILE)) != NULL) {
-		/* first try the general setting */
-		slot = iniparser_getint(ini, "general:" CONFYKSLOT, slot);
+	return second_factor;
+}
 
-		sprintf(section_ykslot, "%d:" CONFYKSLOT, serial);
+/*** get_response ***/
+static void * get_response(void * arg) {
+	struct key * key = arg;
+	char passphrase[PASSPHRASELEN + 1];
+	uint8_t done;
 
-		/* then probe for setting with serial number */
-		slot = iniparser_getint(ini, section_ykslot, slot);
+	memset(passphrase, 0, PASSPHRASELEN + 1);
 
-		switch (slot) {
-			case 1:
-			case SLOT_CHAL_HMAC1:
-				slot = SLOT_CHAL_HMAC1;
-				break;
-			case 2:
-			case SLOT_CHAL_HMAC2:
-			default:
-				slot = SLOT_CHAL_HMAC2;
-				break;
-		}
+	/* another Yubikey may have been faster already */
+	pthread_mutex_lock(&winner.mutex);
+	done = winner.done;
+	pthread_mutex_unlock(&winner.mutex);
 
-		iniparser_freedict(ini);
-	}
-
-	/* open Yubikey and check serial */
-	if ((yk = yk_open_and_check(serial, NULL)) == NULL) {
-		fprintf(stderr, "yk_open_and_check() failed\n");
-		goto out1;
-	}
+	if (done > 0)
+		goto out;
 
 	/* do challenge/response and encode to hex */
-	if (yk_challenge_response(yk, slot, true,
-			CHALLENGELEN, (unsigned char *) challenge,
-			RESPONSELEN, (unsigned char *) response) == 0) {
-		perror("yk_challenge_response() failed");
-		goto out2;
+	if (ykfde_challenge_response(&key->session, key->challenge, passphrase) != EXIT_SUCCESS) {
+		if (transient(errno) == true) {
+			pthread_mutex_lock(&winner.mutex);
+			winner.transient = true;
+			pthread_mutex_unlock(&winner.mutex);
+		}
+		goto out;
 	}
 
-	yubikey_hex_encode((char *) passphrase, (char *) response, SHA1_DIGEST_SIZE);
-
-out2:
-	/* close Yubikey */
-	if (yk_close_key(yk) == 0)
-		perror("yk_close_key() failed");
+	pthread_mutex_lock(&winner.mutex);
+	if (winner.done == 0 && key->orphan == false) {
+		memcpy(winner.passphrase, passphrase, PASSPHRASELEN);
+		winner.key = key;
+		winner.luks_slot = key->session.luks_slot;
+		winner.done = 1;
+	}
+	pthread_mutex_unlock(&winner.mutex);
 
-out1:
-	memset(response, 0, RESPONSELEN);
+out:
+	memset(passphrase, 0, PASSPHRASELEN + 1);
+
+	pthread_mutex_lock(&winner.mutex);
+	key->running = false;
+	if (key->orphan == true) {
+		/* nobody waits for an orphan, clean up */
+		free_key(key);
+		winner.orphans--;
+	} else
+		winner.running--;
+	pthread_cond_broadcast(&winner.cond);
+	pthread_mutex_unlock(&winner.mutex);
 
-	return EXIT_SUCCESS;
+	return NULL;
 }
 
 /*** add_keyring ***/
@@ -250,7 +529,7 @@ static int add_keyring(const char * passphrase) {
 	 * Put it into session keyring first, set permissions and
 	 * move it to user keyring. */
 	if ((key = add_key("user", "cryptsetup", passphrase,
-			PASSPHRASELEN, KEY_SPEC_USER_KEYRING)) < 0) {
+			PASSPHRASELEN, keyring)) < 0) {
 		perror("add_key() failed");
 		return -1;
 	}
@@ -263,47 +542,296 @@ static int add_keyring(const char * passphrase) {
 	return EXIT_SUCCESS;
 }
 
+/*** get_crypttab ***/
+static int get_crypttab(const char * name, char * source, size_t size, uint32_t * flags) {
+	int rc = EXIT_FAILURE;
+	FILE * crypttab;
+	char * line = NULL, * field, * option, * saveptr, * saveopt;
+	const char * tag, * path;
+	size_t len = 0;
+
+	if ((crypttab = fopen(crypttab_path, "r")) == NULL) {
+		perror("Failed opening crypttab");
+		return rc;
+	}
+
+	while (getline(&line, &len, crypttab) > 0) {
+		/* first field is the name, skip comments and other devices */
+		if ((field = strtok_r(line, CRYPTTAB_DELIM, &saveptr)) == NULL ||
+				*field == '#' || strcmp(field, name) != 0)
+			continue;
+
+		/* second field is the source device, resolve tags */
+		if ((field = strtok_r(NULL, CRYPTTAB_DELIM, &saveptr)) == NULL)
+			break;
+		if (strncmp(field, "UUID=", 5) == 0)
+			tag = "/dev/disk/by-uuid/", path = field + 5;
+		else if (strncmp(field, "PARTUUID=", 9) == 0)
+			tag = "/dev/disk/by-partuuid/", path = field + 9;
+		else if (strncmp(field, "LABEL=", 6) == 0)
+			tag = "/dev/disk/by-label/", path = field + 6;
+		else if (strncmp(field, "PARTLABEL=", 10) == 0)
+			tag = "/dev/disk/by-partlabel/", path = field + 10;
+		else
+			tag = "", path = field;
+		if (snprintf(source, size, "%s%s", tag, path) >= size)
+			break;
+
+		/* third field is the key file, fourth are the options */
+		*flags = 0;
+		if (strtok_r(NULL, CRYPTTAB_DELIM, &saveptr) != NULL &&
+				(field = strtok_r(NULL, CRYPTTAB_DELIM, &saveptr)) != NULL)
+			for (option = strtok_r(field, OPTIONS_DELIM, &saveopt); option != NULL;
+					option = strtok_r(NULL, OPTIONS_DELIM, &saveopt))
+				if (strcmp(option, "discard") == 0)
+					*flags |= CRYPT_ACTIVATE_ALLOW_DISCARDS;
+
+		rc = EXIT_SUCCESS;
+		break;
+	}
+
+	free(line);
+	fclose(crypttab);
+
+	return rc;
+}
+
+/*** token_derived ***/
+static int token_derived(struct crypt_device * cryptdevice, int luks_slot) {
+	const char * type, * json, * value;
+	int i, token_max;
+
+	/* tokens exist in LUKS2 only */
+	if ((type = crypt_get_type(cryptdevice)) == NULL || strcmp(type, CRYPT_LUKS2) != 0)
+		return -1;
+
+	/* The token ykfde wrote for the key slot tells whether it was
+	 * enrolled with derived passphrase. This is header metadata, no
+	 * pbkdf is involved. Derive is a general setting, so any of our
+	 * tokens will do if the slot is not known. */
+	token_max = crypt_token_max(CRYPT_LUKS2);
+	for (i = 0; i < token_max; i++) {
+		if (crypt_token_status(cryptdevice, i, &type) < CRYPT_TOKEN_EXTERNAL ||
+				type == NULL || strcmp(type, TOKENTYPE) != 0)
+			continue;
+		if (luks_slot != CRYPT_ANY_SLOT &&
+				crypt_token_is_assigned(cryptdevice, i, luks_slot) != 0)
+			continue;
+		if (crypt_token_json_get(cryptdevice, i, &json) < 0 ||
+				(value = strstr(json, "\"" TOKENDERIVED "\"")) == NULL)
+			continue;
+		value += strlen(TOKENDERIVED) + 2;
+		value += strspn(value, " \t\n:");
+		return strncmp(value, "true", 4) == 0;
+	}
+
+	return -1;
+}
+
+/*** device_passphrase ***/
+static int device_passphrase(const char * source, const char * passphrase, char * derived) {
+	int rc = EXIT_FAILURE, luks_slot;
+	struct crypt_device * cryptdevice;
+
+	if (crypt_init(&cryptdevice, source) < 0) {
+		fprintf(stderr, "Device %s failed to initialize.\n", source);
+		return rc;
+	}
+
+	if (crypt_load(cryptdevice, CRYPT_LUKS, NULL) < 0) {
+		fprintf(stderr, "Device %s is not a LUKS device.\n", source);
+		goto out;
+	}
+
+	/* The device may not be enrolled with derived passphrase yet,
+	 * answer the response then. Trying the key slot would cost a
+	 * pbkdf that systemd-cryptsetup runs again, so the token decides.
+	 * Without token we go with the index. */
+	if ((luks_slot = winner.luks_slot) < 0)
+		luks_slot = CRYPT_ANY_SLOT;
+	if (token_derived(cryptdevice, luks_slot) == 0) {
+		fprintf(stderr, "Device %s is not enrolled with derived passphrase, run 'ykfde' "
+				"to enroll it. Answering the response.\n", source);
+		memcpy(derived, passphrase, PASSPHRASELEN + 1);
+	} else if (ykfde_derive_passphrase(passphrase, crypt_get_uuid(cryptdevice), derived) != EXIT_SUCCESS)
+		goto out;
+
+	rc = EXIT_SUCCESS;
+
+out:
+	crypt_free(cryptdevice);
+
+	return rc;
+}
+
+/*** unescape ***/
+static void unescape(char * dst, const char * src, size_t size) {
+	unsigned int c;
+
+	/* systemd escapes the id in C style, we care for \\ and \xNN */
+	while (*src != 0 && size > 1) {
+		if (src[0] == '\\' && src[1] == 'x' &&
+				isxdigit((unsigned char) src[2]) && isxdigit((unsigned char) src[3]) &&
+				sscanf(src + 2, "%2x", &c) == 1) {
+			*dst = c;
+			src += 4;
+		} else if (src[0] == '\\' && src[1] != 0) {
+			*dst = src[1];
+			src += 2;
+		} else
+			*dst = *src++;
+		dst++;
+		size--;
+	}
+	*dst = 0;
+}
+
+/*** parse_askpass ***/
+static int parse_askpass(const char * ask_file, struct ask * ask) {
+	char buffer[ASK_FILE_MAX], * line, * value, * saveptr = NULL;
+	bool section = false;
+	ssize_t len;
+	int fd;
+
+	memset(ask, 0, sizeof(struct ask));
+
+	/* the file is written in one go before it is renamed in place */
+	if ((fd = open(ask_file, O_RDONLY | O_CLOEXEC)) < 0) {
+		if (errno != ENOENT)
+			perror("Failed opening ask file");
+		return EXIT_FAILURE;
+	}
+	len = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (len < 0) {
+		perror("Failed reading ask file");
+		return EXIT_FAILURE;
+	}
+	buffer[len] = 0;
+
+	/* we need three keys in section [Ask], no complete ini parser */
+	for (line = strtok_r(buffer, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr)) {
+		if (*line == '[') {
+			section = (strncmp(line, "[Ask]", 5) == 0);
+			continue;
+		}
+		if (section == false || (value = strchr(line, '=')) == NULL)
+			continue;
+		*value++ = 0;
+
+		if (strcmp(line, "Id") == 0)
+			unescape(ask->id, value, sizeof(ask->id));
+		else if (strcmp(line, "Socket") == 0 && strlen(value) < sizeof(ask->socket))
+			strcpy(ask->socket, value);
+		else if (strcmp(line, "NotAfter") == 0)
+			ask->not_after = strtoull(value, NULL, 10);
+	}
+
+	return *ask->socket != 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*** set_ask_sources ***/
+static void set_ask_sources(void) {
+	struct ykfde_session * session = &winner.key->session;
+	char source[PATH_MAX], path[PATH_MAX];
+	unsigned int i;
+	uint32_t flags;
+
+	while (ask_sources_count > 0)
+		free(ask_sources[--ask_sources_count]);
+
+	/* without crypttab we can not tell, answer all requests */
+	if (access(crypttab_path, F_OK) < 0)
+		return;
+
+	for (i = 0; i < session->devices_count; i++) {
+		if (get_crypttab(session->devices[i], source, sizeof(source), &flags) != EXIT_SUCCESS)
+			continue;
+		if (realpath(source, path) == NULL)
+			strcpy(path, source);
+		if ((ask_sources[ask_sources_count] = strdup(path)) != NULL)
+			ask_sources_count++;
+	}
+}
+
+/*** ask_routed ***/
+static bool ask_routed(const char * source) {
+	char real[PATH_MAX];
+	const char * path;
+	unsigned int i;
+
+	if (ask_sources_count == 0)
+		return true;
+
+	/* compare device nodes, the names may be different links */
+	if ((path = realpath(source, real)) == NULL)
+		path = source;
+
+	for (i = 0; i < ask_sources_count; i++)
+		if (strcmp(ask_sources[i], path) == 0)
+			return true;
+
+	return false;
+}
+
 /*** answer_askpass ***/
 static int answer_askpass(const char * ask_file, const char * passphrase) {
-	int rc = EXIT_FAILURE, fd_askpass;
-	const char * ask_message, * ask_socket;
-	/* iniparser */
-	dictionary * ini;
+	int rc = EXIT_FAILURE;
+	unsigned int i;
+	struct ask ask;
+	const char * source;
+	char derived[PASSPHRASELEN + 2];
 
-	if ((ini = iniparser_load(ask_file)) == NULL) {
-		perror("cannot parse file");
-		goto out1;
-	}
+	if (parse_askpass(ask_file, &ask) != EXIT_SUCCESS)
+		return rc;
 
-	ask_message = iniparser_getstring(ini, "Ask:Message", NULL);
+	/* the request timed out, nobody is listening */
+	if (ask.not_after > 0 && now_usec() > ask.not_after)
+		return rc;
 
-	if (strncmp(ask_message, ASK_MESSAGE, strlen(ASK_MESSAGE)) != 0)
-		goto out2;
+	/* requests of systemd-cryptsetup only, never the second factor */
+	if (strncmp(ask.id, ASK_ID, strlen(ASK_ID)) != 0)
+		return rc;
+	source = ask.id + strlen(ASK_ID);
 
-	if ((ask_socket = iniparser_getstring(ini, "Ask:Socket", NULL)) == NULL) {
-		perror("Could not get socket name");
-		goto out2;
+	/* do not answer a request twice, it would burn another try
+	 * if the first answer was wrong */
+	for (i = 0; i < ask_answered_count; i++)
+		if (strcmp(ask_answered[i], ask.id) == 0)
+			return rc;
+
+	if (ask_routed(source) == false)
+		return rc;
+
+	/* every device has its own passphrase, derived from response */
+	if ((conf_flags & INDEX_DERIVE) != 0) {
+		if (device_passphrase(source, passphrase + 1, derived + 1) != EXIT_SUCCESS)
+			goto out;
+		*derived = *passphrase;
+		passphrase = derived;
 	}
 
-	if ((fd_askpass = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0)) < 0) {
+	if (fd_askpass < 0 &&
+			(fd_askpass = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0) {
 		perror("socket() failed");
-		goto out2;
+		goto out;
 	}
 
-	if (send_on_socket(fd_askpass, ask_socket, passphrase, PASSPHRASELEN + 1) < 0) {
-		perror("send_on_socket() failed");
-		goto out3;
+	PROBE1(askpass__start, ask_file);
+	if (send_on_socket(fd_askpass, ask.socket, passphrase, PASSPHRASELEN + 1) != EXIT_SUCCESS) {
+		PROBE2(askpass__done, ask_file, 0);
+		goto out;
 	}
+	PROBE2(askpass__done, ask_file, 1);
 
-	rc = EXIT_SUCCESS;
+	if (ask_answered_count < ASK_ANSWERED)
+		ask_answered[ask_answered_count++] = strdup(ask.id);
 
-out3:
-	close(fd_askpass);
+	rc = EXIT_SUCCESS;
 
-out2:
-	iniparser_freedict(ini);
+out:
+	memset(derived, 0, PASSPHRASELEN + 2);
 
-out1:
 	return rc;
 }
 
@@ -314,19 +842,17 @@ static int walk_askpass(const char * passphrase) {
 	struct dirent * ent;
 
 	/* change to directory so we do not have to assemble complete/absolute path */
-	if (chdir(ASK_PATH) != 0) {
+	if (chdir(ask_path) != 0) {
 		perror("chdir() failed");
 		return rc;
 	}
 
-	/* Is the request already there? */
-	if ((dir = opendir(ASK_PATH)) != NULL) {
-		while ((ent = readdir(dir)) != NULL) {
-			if (strncmp(ent->d_name, "ask.", 4) == 0) {
-				if ((rc = answer_askpass(ent->d_name, passphrase)) == EXIT_SUCCESS)
-					goto out;
-			}
-		}
+	/* Are requests already there? Answer all of them, a single
+	 * response unlocks every device. */
+	if ((dir = opendir(".")) != NULL) {
+		while ((ent = readdir(dir)) != NULL)
+			if (strncmp(ent->d_name, "ask.", 4) == 0)
+				answer_askpass(ent->d_name, passphrase);
 	} else {
 		perror ("opendir() failed");
 		return EXIT_FAILURE;
@@ -334,82 +860,585 @@ static int walk_askpass(const char * passphrase) {
 
 	rc = EXIT_SUCCESS;
 
+	closedir(dir);
+
+	return rc;
+}
+
+/*** activate_device ***/
+static int activate_device(const char * name, int luks_slot, const char * passphrase) {
+	int rc = EXIT_FAILURE, r;
+	struct crypt_device * cryptdevice;
+	crypt_status_info cryptstatus;
+	crypt_keyslot_info cryptkeyslot;
+	char source[PATH_MAX], derived[PASSPHRASELEN + 1];
+	const char * key = passphrase;
+	uint32_t flags;
+
+	/* already active, nothing to do */
+	cryptstatus = crypt_status(NULL, name);
+	if (cryptstatus == CRYPT_ACTIVE || cryptstatus == CRYPT_BUSY)
+		return EXIT_SUCCESS;
+
+	if (get_crypttab(name, source, sizeof(source), &flags) != EXIT_SUCCESS) {
+		fprintf(stderr, "Could not find device %s in %s.\n", name, crypttab_path);
+		return rc;
+	}
+
+	if (crypt_init(&cryptdevice, source) < 0) {
+		fprintf(stderr, "Device %s failed to initialize.\n", source);
+		return rc;
+	}
+
+	if (crypt_load(cryptdevice, CRYPT_LUKS, NULL) < 0) {
+		fprintf(stderr, "Device %s is not a LUKS device.\n", source);
+		goto out;
+	}
+
+	/* every device has its own passphrase, derived from response -
+	 * unless its token tells it is not enrolled that way yet */
+	if ((conf_flags & INDEX_DERIVE) != 0 && token_derived(cryptdevice, luks_slot) != 0) {
+		if (ykfde_derive_passphrase(passphrase, crypt_get_uuid(cryptdevice), derived) != EXIT_SUCCESS)
+			goto out;
+		key = derived;
+	}
+
+	/* Try the key slot of this key only, so no pbkdf is wasted on
+	 * other slots. Fall back to all slots if the mapping is wrong. */
+	if (luks_slot != CRYPT_ANY_SLOT) {
+		cryptkeyslot = crypt_keyslot_status(cryptdevice, luks_slot);
+		if (cryptkeyslot != CRYPT_SLOT_ACTIVE && cryptkeyslot != CRYPT_SLOT_ACTIVE_LAST) {
+			fprintf(stderr, "Key slot %d is not in use on device %s, check '"
+					CONFLUKSSLOT "' for serial %d. Trying all slots.\n",
+					luks_slot, name, winner.key->session.serial);
+			luks_slot = CRYPT_ANY_SLOT;
+		}
+	}
+
+	PROBE2(activate__start, name, luks_slot);
+	r = crypt_activate_by_passphrase(cryptdevice, name, luks_slot,
+			key, PASSPHRASELEN, flags);
+	if (r == -EPERM && luks_slot != CRYPT_ANY_SLOT) {
+		fprintf(stderr, "Passphrase does not match key slot %d on device %s, check '"
+				CONFLUKSSLOT "' for serial %d. Trying all slots.\n",
+				luks_slot, name, winner.key->session.serial);
+		luks_slot = CRYPT_ANY_SLOT;
+		r = crypt_activate_by_passphrase(cryptdevice, name, luks_slot,
+				key, PASSPHRASELEN, flags);
+	}
+	/* the device may not be enrolled with derived passphrase yet */
+	if (r == -EPERM && key != passphrase) {
+		fprintf(stderr, "Derived passphrase does not match device %s, run 'ykfde' "
+				"to enroll it. Trying the response.\n", name);
+		r = crypt_activate_by_passphrase(cryptdevice, name, luks_slot,
+				passphrase, PASSPHRASELEN, flags);
+	}
+	if (r < 0) {
+		PROBE2(activate__done, name, 0);
+		fprintf(stderr, "Failed to activate device %s.\n", name);
+		goto out;
+	}
+	PROBE2(activate__done, name, 1);
+
+	rc = EXIT_SUCCESS;
+
 out:
+	crypt_free(cryptdevice);
+	memset(derived, 0, PASSPHRASELEN + 1);
+
+	return rc;
+}
+
+/*** activate_devices ***/
+static int activate_devices(const char * passphrase) {
+	int rc = EXIT_SUCCESS, luks_slot;
+	struct ykfde_session * session = &winner.key->session;
+	unsigned int i;
+
+	if (session->devices_count == 0)
+		return EXIT_FAILURE;
+
+	/* the key slot this key was enrolled to */
+	if ((luks_slot = session->luks_slot) < 0)
+		luks_slot = CRYPT_ANY_SLOT;
+
+	for (i = 0; i < session->devices_count; i++)
+		if (activate_device(session->devices[i], luks_slot, passphrase) != EXIT_SUCCESS)
+			rc = EXIT_FAILURE;
+
+	return rc;
+}
+
+/*** askpass_pending ***/
+static bool askpass_pending(void) {
+	bool pending = false;
+	DIR * dir;
+	struct dirent * ent;
+	char path[PATH_MAX];
+	struct ask ask;
+
+	if ((dir = opendir(ask_path)) == NULL)
+		return false;
+
+	/* the request for second factor does not count */
+	while ((ent = readdir(dir)) != NULL) {
+		if (strncmp(ent->d_name, "ask.", 4) != 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", ask_path, ent->d_name);
+		if (parse_askpass(path, &ask) == EXIT_SUCCESS &&
+				strncmp(ask.id, ASK_ID, strlen(ASK_ID)) == 0) {
+			pending = true;
+			break;
+		}
+	}
+
 	closedir(dir);
 
+	return pending;
+}
+
+/*** get_passphrase ***/
+static int get_passphrase(char * passphrase) {
+	int rc = EXIT_FAILURE;
+	unsigned int i;
+	struct key * key;
+	char * second_factor;
+	size_t second_factor_len = 0;
+	uint64_t start;
+	bool retry;
+
+	/* open all Yubikeys with a challenge, errno tells
+	 * whether to try again */
+	if (open_keys(&retry) == 0) {
+		errno = retry == true ? EAGAIN : ENODEV;
+		return rc;
+	}
+
+	/* Everything is prepared while the user is typing the second
+	 * factor, what is left once we have it is challenge-response. */
+	start = now_usec();
+	if ((conf_flags & INDEX_2NDFACTOR) != 0) {
+		/* without second factor the response would be wrong,
+		 * and a wrong answer wastes a try */
+		if (second_factor_waited == false) {
+			second_factor_waited = true;
+			second_factor = wait_second_factor();
+		} else
+			second_factor = get_second_factor();
+		if (second_factor == NULL) {
+			timings[PHASE_2NDFACTOR] = now_usec() - start;
+			errno = ENOKEY;
+			return rc;
+		}
+	} else
+		second_factor = get_second_factor();
+	if (second_factor != NULL)
+		second_factor_len = strlen(second_factor);
+	timings[PHASE_2NDFACTOR] = now_usec() - start;
+
+	/* we replace part of the challenge with the second factor */
+	for (i = 0; i < keys_count && second_factor != NULL; i++)
+		ykfde_second_factor(keys[i]->challenge, second_factor, second_factor_len);
+
+	if (second_factor != NULL) {
+		memset(second_factor, 0, second_factor_len);
+		free(second_factor);
+	}
+
+	/* run challenge/response on all Yubikeys in parallel */
+	start = now_usec();
+	pthread_mutex_lock(&winner.mutex);
+	winner.done = 0;
+	winner.transient = false;
+	winner.running = 0;
+	winner.passphrase = passphrase;
+
+	/* threads are detached, the first response is all we wait for */
+	for (i = 0; i < keys_count; i++) {
+		key = keys[i];
+		if ((errno = pthread_create(&key->thread, NULL, get_response, key)) != 0) {
+			perror("pthread_create() failed");
+			continue;
+		}
+		pthread_detach(key->thread);
+		key->running = true;
+		winner.running++;
+	}
+
+	/* wait for the first response */
+	while (winner.done == 0 && winner.running > 0)
+		pthread_cond_wait(&winner.cond, &winner.mutex);
+
+	if (winner.done > 0)
+		rc = EXIT_SUCCESS;
+	else
+		errno = winner.transient == true ? EAGAIN : EIO;
+	pthread_mutex_unlock(&winner.mutex);
+	timings[PHASE_RESPONSE] = now_usec() - start;
+
+	return rc;
+}
+
+/*** retry_passphrase ***/
+static int retry_passphrase(char * passphrase) {
+	uint64_t deadline, delay = RETRY_DELAY_MIN * 1000;
+	struct timespec ts;
+	uint32_t jitter;
+	int rc;
+
+	deadline = now_usec() + (uint64_t) retry_deadline * 1000;
+
+	/* Keys that are busy or not ready yet after they were plugged
+	 * are tried again, with backoff. The time to unlock is bounded
+	 * by the deadline, keys that are not enrolled fail right away. */
+	while ((rc = get_passphrase(passphrase)) != EXIT_SUCCESS && errno == EAGAIN) {
+		close_keys();
+
+		/* wait for half the delay plus random jitter, so keys
+		 * plugged at the same time are not hit in lockstep */
+		if (getrandom(&jitter, sizeof(jitter), GRND_NONBLOCK) != sizeof(jitter))
+			jitter = 0;
+		ts.tv_sec = 0;
+		ts.tv_nsec = (delay / 2 + jitter % (delay / 2 + 1)) * 1000;
+
+		if (now_usec() + ts.tv_nsec / 1000 > deadline || stopping() == true) {
+			errno = EAGAIN;
+			break;
+		}
+
+		nanosleep(&ts, NULL);
+		if ((delay *= 2) > RETRY_DELAY_MAX * 1000)
+			delay = RETRY_DELAY_MAX * 1000;
+	}
+
+	return rc;
+}
+
+/*** unlock ***/
+static int unlock(char * passphrase) {
+	int rc;
+	uint64_t start;
+
+	/* the per key phases add up, start from scratch */
+	memset(timings + PHASE_OPEN, 0, (PHASE_MAX - PHASE_OPEN) * sizeof(uint64_t));
+
+	/* get passphrase from the fastest Yubikey */
+	if ((rc = retry_passphrase(passphrase + 1)) != EXIT_SUCCESS)
+		goto out;
+
+	/* requests are answered for devices of this key only */
+	set_ask_sources();
+
+	/* leave the response for rotation after boot, it is not
+	 * critical if this fails */
+	if ((conf_flags & INDEX_REUSE) != 0)
+		ykfde_save_response(&winner.key->session, winner.key->challenge, passphrase + 1);
+
+	/* Activate the devices ourself if nobody asked for a passphrase
+	 * yet. systemd-cryptsetup finds them active then. If a request
+	 * is already waiting it has to be answered. */
+	if ((conf_flags & INDEX_ACTIVATE) != 0 &&
+			askpass_pending() == false) {
+		start = now_usec();
+		rc = activate_devices(passphrase + 1);
+		timings[PHASE_ACTIVATE] = now_usec() - start;
+		if (rc == EXIT_SUCCESS) {
+			report_timings();
+			goto out;
+		}
+	}
+
+	/* with derived passphrases the key in keyring would not match */
+	if ((conf_flags & INDEX_DERIVE) == 0) {
+		start = now_usec();
+		PROBE(keyring__start);
+		rc = add_keyring(passphrase + 1);
+		PROBE1(keyring__done, rc);
+		timings[PHASE_KEYRING] = now_usec() - start;
+		if (rc < 0)
+			goto out;
+	}
+
+	start = now_usec();
+	rc = walk_askpass(passphrase);
+	timings[PHASE_ASKPASS] = now_usec() - start;
+	if (rc < 0)
+		goto out;
+
+	report_timings();
+
+out:
+	/* close all Yubikeys */
+	close_keys();
+
+	return rc;
+}
+
+/*** run_resident ***/
+static int run_resident(char * passphrase) {
+	int rc = EXIT_FAILURE, fd_signal, fd_inotify, timeout, ready;
+	uint8_t have_passphrase = 0;
+	sigset_t mask;
+	struct pollfd fds[3];
+	/* inotify */
+	char buffer[sizeof(struct inotify_event) + NAME_MAX + 1]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event * event;
+	ssize_t len;
+	char * ptr;
+	/* udev */
+	struct udev * udev;
+	struct udev_monitor * monitor;
+	struct udev_device * device;
+	const char * action, * vendor;
+
+	/* make sure the directory exists, we want to watch it */
+	if (mkdir(ask_path, 0755) < 0 && errno != EEXIST) {
+		perror("mkdir() failed");
+		goto out10;
+	}
+
+	/* change to directory so we do not have to assemble complete/absolute path */
+	if (chdir(ask_path) != 0) {
+		perror("chdir() failed");
+		goto out10;
+	}
+
+	/* we want to exit cleanly when stopped */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+		perror("sigprocmask() failed");
+		goto out10;
+	}
+
+	if ((fd_signal = signalfd(-1, &mask, SFD_CLOEXEC)) < 0) {
+		perror("signalfd() failed");
+		goto out10;
+	}
+
+	/* watch for new password requests */
+	if ((fd_inotify = inotify_init1(IN_CLOEXEC)) < 0) {
+		perror("inotify_init1() failed");
+		goto out20;
+	}
+
+	if (inotify_add_watch(fd_inotify, ask_path, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		perror("inotify_add_watch() failed");
+		goto out30;
+	}
+
+	/* watch for Yubikeys being plugged */
+	if ((udev = udev_new()) == NULL) {
+		perror("udev_new() failed");
+		goto out30;
+	}
+
+	if ((monitor = udev_monitor_new_from_netlink(udev, "udev")) == NULL) {
+		perror("udev_monitor_new_from_netlink() failed");
+		goto out40;
+	}
+
+	if (udev_monitor_filter_add_match_subsystem_devtype(monitor, "usb", "usb_device") < 0 ||
+			udev_monitor_enable_receiving(monitor) < 0) {
+		perror("udev_monitor_enable_receiving() failed");
+		goto out50;
+	}
+
+	/* Everything is watched now, tell systemd before we may wait
+	 * for second factor. Then handle what is already there. */
+	sd_notify(0, "READY=1\nSTATUS=Waiting for Yubikey and password requests...");
+
+	if (unlock(passphrase) == EXIT_SUCCESS)
+		have_passphrase = 1;
+
+	fds[0].fd = fd_signal;
+	fds[0].events = POLLIN;
+	fds[1].fd = fd_inotify;
+	fds[1].events = POLLIN;
+	fds[2].fd = udev_monitor_get_fd(monitor);
+	fds[2].events = POLLIN;
+
+	while (1) {
+		/* the second factor may show up after we gave up waiting */
+		timeout = have_passphrase == 0 && (conf_flags & INDEX_2NDFACTOR) != 0 ?
+			SECOND_FACTOR_RECHECK : -1;
+
+		if ((ready = poll(fds, 3, timeout)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll() failed");
+			goto out50;
+		}
+
+		if (ready == 0) {
+			if (has_second_factor() == true && unlock(passphrase) == EXIT_SUCCESS)
+				have_passphrase = 1;
+			continue;
+		}
+
+		/* we were told to stop */
+		if (fds[0].revents & POLLIN)
+			break;
+
+		/* a Yubikey was plugged */
+		if (fds[2].revents & POLLIN &&
+				(device = udev_monitor_receive_device(monitor)) != NULL) {
+			action = udev_device_get_action(device);
+			vendor = udev_device_get_sysattr_value(device, "idVendor");
+
+			if (have_passphrase == 0 && action != NULL && vendor != NULL &&
+					strcmp(action, "add") == 0 && strcmp(vendor, YUBICO_VENDOR) == 0 &&
+					unlock(passphrase) == EXIT_SUCCESS)
+				have_passphrase = 1;
+
+			udev_device_unref(device);
+		}
+
+		/* a password request showed up */
+		if (fds[1].revents & POLLIN) {
+			if ((len = read(fd_inotify, buffer, sizeof(buffer))) < 0) {
+				perror("read() failed");
+				goto out50;
+			}
+
+			for (ptr = buffer; ptr < buffer + len; ptr += sizeof(struct inotify_event) + event->len) {
+				event = (const struct inotify_event *) ptr;
+
+				if (have_passphrase > 0 && event->len > 0 &&
+						strncmp(event->name, "ask.", 4) == 0)
+					answer_askpass(event->name, passphrase);
+			}
+		}
+	}
+
+	rc = EXIT_SUCCESS;
+
+out50:
+	udev_monitor_unref(monitor);
+
+out40:
+	udev_unref(udev);
+
+out30:
+	close(fd_inotify);
+
+out20:
+	close(fd_signal);
+
+out10:
 	return rc;
 }
 
 /*** main ***/
 int main(int argc, char **argv) {
+	int i;
 	int8_t rc = EXIT_FAILURE;
-	/* Yubikey */
-	YK_KEY * yk;
-	uint8_t slot = SLOT_CHAL_HMAC2;
-	unsigned int serial = 0;
-	/* challenge and passphrase */
-	char challenge[CHALLENGELEN + 1];
+	unsigned int help = 0, resident = 0;
+	/* iniparser */
+	dictionary * ini;
+	/* passphrase */
 	char passphrase[PASSPHRASELEN + 2];
 
+	/* get command line options */
+	while ((i = getopt_long(argc, argv, optstring, options_long, NULL)) != -1)
+		switch (i) {
+			case 'h':
+				help++;
+				break;
+			case 'r':
+				resident++;
+				break;
+		}
+
+	if (help > 0) {
+		fprintf(stderr, "usage: %s [-h|--help] [-r|--resident]\n", argv[0]);
+		return EXIT_SUCCESS;
+	}
+
 #ifdef DEBUG
 	/* reopening stderr to /dev/console may help debugging... */
 	FILE * tmp = freopen("/dev/console", "w", stderr);
 	(void) tmp;
 #endif
 
-	/* check that we are running from systemd */
-	if (sd_notify(0, "READY=0\nSTATUS=Work in progress...") <= 0) {
-		fprintf(stderr, "This is expected to run from a systemd service.\n");
-		goto out10;
-	}
+	/* We are expected to run from systemd service, but without
+	 * notification socket (for testing) we do the same work. */
+	if (sd_notify(0, "READY=0\nSTATUS=Work in progress...") <= 0)
+		fprintf(stderr, "Not running from a systemd service, can not notify.\n");
 
 	/* initialize static memory */
-	memset(challenge, 0, CHALLENGELEN + 1);
 	memset(passphrase, 0, PASSPHRASELEN + 2);
 
 	*passphrase = '+';
 
-	/* init and open first Yubikey */
-	if (yk_init() == 0) {
-		perror("yk_init() failed");
-		goto out10;
+	/* The index from cpio archive has everything we need, we parse
+	 * the config file only if it is missing or incomplete.
+	 * If this fails we do not care... defaults are fine. */
+	timings_start = now_usec();
+	ini = NULL;
+	ask_path = ykfde_path("YKFDE_ASK_PATH", ASK_PATH);
+	timings_path = ykfde_path("YKFDE_TIMINGS_PATH", TIMINGS_PATH);
+	crypttab_path = ykfde_path("YKFDE_CRYPTTAB", CRYPTTAB);
+	keyring = ykfde_keyring();
+	if (ykfde_index_open(YKFDE_INDEXFILE, &conf_flags) != EXIT_SUCCESS ||
+			(conf_flags & INDEX_CONFIG) != 0)
+		ini = iniparser_load(YKFDE_CONFIGFILE);
+
+	if (ini != NULL) {
+		conf_flags = 0;
+		if (iniparser_getboolean(ini, "general:" CONF2NDFACTOR, 0) > 0)
+			conf_flags |= INDEX_2NDFACTOR;
+		if (iniparser_getboolean(ini, "general:" CONFACTIVATE, 0) > 0)
+			conf_flags |= INDEX_ACTIVATE;
+		if (iniparser_getboolean(ini, "general:" CONFREUSERESPONSE, 0) > 0)
+			conf_flags |= INDEX_REUSE;
+		if (iniparser_getboolean(ini, "general:" CONFDERIVE, 0) > 0)
+			conf_flags |= INDEX_DERIVE;
+		if ((i = iniparser_getint(ini, "general:" CONFRETRYDEADLINE, RETRYDEADLINE)) >= 0)
+			retry_deadline = i;
 	}
 
-	/* open Yubikey and get serial */
-	if ((yk = yk_open_and_check(0, &serial)) == NULL) {
-		if (errno == EAGAIN)
-			rc = EXIT_SUCCESS;
-		goto out30;
-	}
+	/* init challenge-response backend */
+	if (ykfde_init(ini) != EXIT_SUCCESS)
+		goto out15;
+	timings[PHASE_INIT] = now_usec() - timings_start;
 
-	/* close Yubikey */
-	if (yk_close_key(yk) == 0) {
-		perror("yk_close_key() failed");
+	if (resident > 0) {
+		/* stay around, answer requests as they show up */
+		rc = run_resident(passphrase);
 		goto out30;
 	}
 
-	if ((rc = read_challenge(serial, challenge)) < 0)
-		goto out30;
-
-	if ((rc = get_response(serial, slot, challenge, passphrase + 1)) < 0)
-		goto out30;
-
-	if ((rc = add_keyring(passphrase + 1)) < 0)
-		goto out30;
-
-	if ((rc = walk_askpass(passphrase)) < 0)
-		goto out30;
+	/* no (responsive) Yubikey is not an error */
+	if ((rc = unlock(passphrase)) != EXIT_SUCCESS && (errno == EAGAIN || errno == ENODEV))
+		rc = EXIT_SUCCESS;
 
 out30:
-	/* release Yubikey */
-	if (yk_release() == 0)
-		perror("yk_release() failed");
+	/* release backend - unless slower Yubikeys are still in
+	 * challenge-response, exit cleans up then */
+	pthread_mutex_lock(&winner.mutex);
+	if (winner.orphans == 0)
+		ykfde_release();
+	pthread_mutex_unlock(&winner.mutex);
+
+out15:
+	/* free iniparser dictionary and index */
+	if (ini != NULL)
+		iniparser_freedict(ini);
+	ykfde_index_close();
 
-out10:
-	/* wipe challenge from memory */
-	memset(challenge, 0, CHALLENGELEN + 1);
+	/* wipe passphrase from memory */
 	memset(passphrase, 0, PASSPHRASELEN + 2);
 
+	while (ask_answered_count > 0)
+		free(ask_answered[--ask_answered_count]);
+	while (ask_sources_count > 0)
+		free(ask_sources[--ask_sources_count]);
+	if (fd_askpass >= 0)
+		close(fd_askpass);
+
 	/* notify systemd that we are ready
 	   This does not indicate whether or not we are successful, but prevents
 	   systemd from reporting: Failed with result 'protocol'. */
@@ -16,26 +16,97 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <dirent.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
+
+#include <iniparser/iniparser.h>
 
 #include <archive.h>
 #include <archive_entry.h>
 
+#include <ykpers-1/ykdef.h>
+
 #include "../config.h"
 #include "../version.h"
+#include "index.h"
+#include "libykfde.h"
+#include "probes.h"
+#include "sha1.h"
 
 #define PROGNAME "ykfde-cpio"
 
-const static char optstring[] = "hV";
+/* format parameters, these go into the manifest */
+#define FORMAT	"cpio_newc"
+
+/* minimum number of runs and time per codec in benchmark */
+#define BENCH_RUNS	10
+#define BENCH_USEC	200000
+
+/* Compression filters, all of these can be unpacked by the kernel.
+ * Note that lz4 is missing: libarchive writes the lz4 frame format,
+ * but the kernel understands legacy lz4 only. The kernel's xz decoder
+ * takes crc32 or no integrity check, libarchive's xz writer has crc64
+ * hardcoded - so xz is run as external program, just like mkinitcpio
+ * and dracut do. */
+struct filter {
+	const char * name;
+	int (*add)(struct archive *);
+	/* external program, the level is appended as option */
+	const char * program;
+	/* range of compression level, -1 if not supported */
+	int level_min;
+	int level_max;
+};
+
+static const struct filter filters[] = {
+	{ "none",	archive_write_add_filter_none,	NULL,			-1,	-1 },
+	{ "gzip",	archive_write_add_filter_gzip,	NULL,			0,	9 },
+	{ "xz",		NULL,				"xz --check=crc32",	0,	9 },
+	{ "zstd",	archive_write_add_filter_zstd,	NULL,			1,	22 },
+	{ NULL,		NULL,				NULL,			-1,	-1 }
+};
+
+/* the challenge files, sorted by name, with content read
+ * into one contiguous buffer */
+struct file {
+	const char * name;
+	size_t size;
+	size_t offset;
+};
+
+struct challenges {
+	struct dirent ** ents;
+	int count;
+	struct file * files;
+	unsigned int nfiles;
+	char * data;
+	size_t data_len;
+	size_t data_size;
+	struct index_header * index;
+	size_t index_size;
+};
+
+const static char optstring[] = "bc:fhjl:V";
 const static struct option options_long[] = {
 	/* name			has_arg			flag	val */
+	{ "bench",		no_argument,		NULL,	'b' },
+	{ "compression",	required_argument,	NULL,	'c' },
+	{ "level",		required_argument,	NULL,	'l' },
+	{ "force",		no_argument,		NULL,	'f' },
 	{ "help",		no_argument,		NULL,	'h' },
+	{ "json",		no_argument,		NULL,	'j' },
 	{ "version",		no_argument,		NULL,	'V' },
 	{ 0, 0, 0, 0 }
 };
@@ -71,168 +142,725 @@ out:
 	return rc;
 }
 
-int main(int argc, char **argv) {
-	int i;
-	unsigned int version = 0, help = 0;
-	char cpiotmpfile[] = CPIOTMPFILE;
-	struct archive *archive;
-	struct archive_entry *entry;
-	struct stat st;
-	char buff[64];
-	int len, fdfile, fdarchive;
-	DIR * dir;
-	struct dirent * ent;
-	char * filename, * path;
-	off_t pathlength = 0;
+/*** filter_dots ***/
+static int filter_dots(const struct dirent * ent) {
+	return strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0;
+}
+
+/*** get_filter ***/
+static const struct filter * get_filter(const char * name) {
+	const struct filter * filter;
+
+	for (filter = filters; filter->name != NULL; filter++)
+		if (strcmp(filter->name, name) == 0)
+			return filter;
+
+	fprintf(stderr, "Unknown compression %s.\n", name);
+
+	return NULL;
+}
+
+/*** filter_level ***/
+static int filter_level(const struct filter * filter, const int level) {
+	/* default level, or the codec does not take one */
+	if (level < 0 || filter->level_max < 0)
+		return -1;
+
+	/* levels differ per codec, clamp to what it takes */
+	if (level < filter->level_min)
+		return filter->level_min;
+	if (level > filter->level_max)
+		return filter->level_max;
+
+	return level;
+}
+
+/*** now_usec ***/
+static uint64_t now_usec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*** read_challenges ***/
+static int read_challenges(struct challenges * challenges) {
 	int8_t rc = EXIT_FAILURE;
+	struct stat st;
+	struct file * file;
+	ssize_t len;
+	char * data;
+	int fddir, fdfile, i;
 
-	/* get command line options */
-	while ((i = getopt_long(argc, argv, optstring, options_long, NULL)) != -1)
-		switch (i) {
-			case 'h':
-				help++;
-				break;
-			case 'V':
-				version++;
-				break;
+	if ((fddir = open(YKFDE_CHALLENGEDIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		perror("open() failed");
+		goto out10;
+	}
+
+	/* sort entries, we need a stable order */
+	if ((challenges->count = scandirat(fddir, ".", &challenges->ents, filter_dots, alphasort)) < 0) {
+		perror("scandirat() failed");
+		goto out20;
+	}
+
+	if ((challenges->files = calloc(challenges->count + 1, sizeof(struct file))) == NULL) {
+		perror("calloc() failed");
+		goto out20;
+	}
+
+	for (i = 0; i < challenges->count; i++) {
+		if (fstatat(fddir, challenges->ents[i]->d_name, &st, 0) < 0) {
+			perror("fstatat() failed");
+			goto out20;
 		}
 
-	if (version > 0)
-		printf("%s: %s v%s (compiled: " __DATE__ ", " __TIME__ ")\n", argv[0], PROGNAME, VERSION);
+		if (!S_ISREG(st.st_mode))
+			continue;
 
-	if (help > 0)
-		fprintf(stderr, "usage: %s [-h|--help] [-V|--version]\n", argv[0]);
+		/* make sure the content fits into buffer */
+		if (challenges->data_len + st.st_size > challenges->data_size) {
+			challenges->data_size = (challenges->data_len + st.st_size) * 2;
+			if ((data = realloc(challenges->data, challenges->data_size)) == NULL) {
+				perror("realloc() failed");
+				goto out20;
+			}
+			challenges->data = data;
+		}
 
-	if (version > 0 || help > 0)
-		return EXIT_SUCCESS;
+		if ((fdfile = openat(fddir, challenges->ents[i]->d_name, O_RDONLY | O_CLOEXEC)) < 0) {
+			perror("openat() failed");
+			goto out20;
+		}
 
-	if ((fdarchive = mkstemp(cpiotmpfile)) < 0) {
-		perror("mkstemp() failed");
-		goto out10;
+		file = &challenges->files[challenges->nfiles++];
+		file->name = challenges->ents[i]->d_name;
+		file->offset = challenges->data_len;
+		len = 0;
+
+		/* the file may have changed size since fstatat(),
+		 * we take what we get */
+		while (file->size < st.st_size &&
+				(len = read(fdfile, challenges->data + file->offset + file->size, st.st_size - file->size)) > 0)
+			file->size += len;
+
+		close(fdfile);
+
+		if (len < 0) {
+			perror("read() failed");
+			goto out20;
+		}
+
+		challenges->data_len += file->size;
 	}
 
-	if ((archive = archive_write_new()) == NULL) {
-		fprintf(stderr, "archive_write_new() failed.\n");
-		goto out10;
+	rc = EXIT_SUCCESS;
+
+out20:
+	close(fddir);
+
+out10:
+	return rc;
+}
+
+/*** get_config ***/
+static const char * get_config(dictionary * ini, unsigned int serial, const char * name) {
+	char confkey[128];
+	const char * value;
+
+	/* key section first, then general */
+	snprintf(confkey, sizeof(confkey), "%u:%s", serial, name);
+	if ((value = iniparser_getstring(ini, confkey, NULL)) != NULL)
+		return value;
+
+	snprintf(confkey, sizeof(confkey), "general:%s", name);
+	return iniparser_getstring(ini, confkey, NULL);
+}
+
+/*** build_index ***/
+static int build_index(struct challenges * challenges, dictionary * ini) {
+	struct index_header * index;
+	struct index_entry * entries, * entry;
+	const struct file * file;
+	const char * value;
+	char confkey[128];
+	unsigned int i, serial;
+	uint32_t buckets = 2, bucket;
+	int end;
+
+	/* keep the table at most half full */
+	while (buckets < challenges->nfiles * 2)
+		buckets *= 2;
+
+	challenges->index_size = sizeof(struct index_header) + buckets * sizeof(struct index_entry);
+	if ((index = calloc(1, challenges->index_size)) == NULL) {
+		perror("calloc() failed");
+		return EXIT_FAILURE;
+	}
+	challenges->index = index;
+	entries = (struct index_entry *) (index + 1);
+
+	memcpy(index->magic, INDEX_MAGIC, sizeof(index->magic));
+	index->version = INDEX_VERSION;
+	index->buckets = buckets;
+
+	if (ini != NULL) {
+		if (iniparser_getboolean(ini, "general:" CONF2NDFACTOR, 0) > 0)
+			index->flags |= INDEX_2NDFACTOR;
+		if (iniparser_getboolean(ini, "general:" CONFACTIVATE, 0) > 0)
+			index->flags |= INDEX_ACTIVATE;
+		if (iniparser_getboolean(ini, "general:" CONFREUSERESPONSE, 0) > 0)
+			index->flags |= INDEX_REUSE;
+		if (iniparser_getboolean(ini, "general:" CONFDERIVE, 0) > 0)
+			index->flags |= INDEX_DERIVE;
+		/* the backend and retries need settings from config file */
+		if (iniparser_getstring(ini, "general:" CONFBACKEND, NULL) != NULL ||
+				iniparser_getstring(ini, "general:" CONFRETRYDEADLINE, NULL) != NULL)
+			index->flags |= INDEX_CONFIG;
 	}
 
-	if (archive_write_set_format_cpio_newc(archive) != ARCHIVE_OK) {
-		fprintf(stderr, "archive_write_set_format_cpio_newc() failed.\n");
-		goto out10;
+	for (i = 0; i < challenges->nfiles; i++) {
+		file = &challenges->files[i];
+
+		/* skip everything that is not a challenge */
+		end = 0;
+		if (sscanf(file->name, "challenge-%u%n", &serial, &end) != 1 ||
+				file->name[end] != 0 || serial == 0)
+			continue;
+
+		for (bucket = index_bucket(serial, buckets); entries[bucket].serial != 0;
+				bucket = (bucket + 1) & (buckets - 1));
+		entry = &entries[bucket];
+
+		entry->serial = serial;
+		memcpy(entry->challenge, challenges->data + file->offset,
+				file->size < sizeof(entry->challenge) ? file->size : sizeof(entry->challenge));
+
+		/* resolve what libykfde would read from config */
+		entry->yk_slot = 2;
+		entry->luks_slot = -1;
+		if (ini == NULL)
+			goto next;
+
+		if ((value = get_config(ini, serial, CONFYKSLOT)) != NULL &&
+				(strtol(value, NULL, 0) == 1 || strtol(value, NULL, 0) == SLOT_CHAL_HMAC1))
+			entry->yk_slot = 1;
+
+		snprintf(confkey, sizeof(confkey), "%u:" CONFLUKSSLOT, serial);
+		entry->luks_slot = iniparser_getint(ini, confkey, -1);
+
+		if ((value = get_config(ini, serial, CONFDEVNAME)) != NULL) {
+			if (strlen(value) >= INDEX_NAMESLEN) {
+				fprintf(stderr, "Device names for Yubikey with serial %u are too long.\n", serial);
+				return EXIT_FAILURE;
+			}
+			strcpy(entry->device_names, value);
+		}
+
+next:
+		index->count++;
 	}
 
-	if (archive_write_open_fd(archive, fdarchive) != ARCHIVE_OK) {
-		fprintf(stderr, "archive_write_open_fd() failed.\n");
-		goto out10;
+	return EXIT_SUCCESS;
+}
+
+/*** get_manifest ***/
+static void get_manifest(const struct challenges * challenges, const struct filter * filter,
+		int level, char * manifest) {
+	struct sha1 ctx;
+	const struct file * file;
+	uint8_t digest[SHA1_HASHLEN];
+	uint64_t size;
+	unsigned int i;
+
+	/* the level that is actually used, if any */
+	level = filter_level(filter, level);
+
+	sha1_init(&ctx);
+	sha1_update(&ctx, FORMAT, sizeof(FORMAT));
+	sha1_update(&ctx, filter->name, strlen(filter->name) + 1);
+	sha1_update(&ctx, &level, sizeof(level));
+	sha1_update(&ctx, YKFDE_CHALLENGEDIR, strlen(YKFDE_CHALLENGEDIR) + 1);
+
+	for (i = 0; i < challenges->nfiles; i++) {
+		file = &challenges->files[i];
+		size = file->size;
+		sha1_update(&ctx, file->name, strlen(file->name) + 1);
+		sha1_update(&ctx, &size, sizeof(size));
+		sha1_update(&ctx, challenges->data + file->offset, file->size);
+	}
+
+	/* the index has what matters from config file */
+	sha1_update(&ctx, YKFDE_INDEXFILE, strlen(YKFDE_INDEXFILE) + 1);
+	sha1_update(&ctx, challenges->index, challenges->index_size);
+
+	sha1_final(&ctx, digest);
+	for (i = 0; i < SHA1_HASHLEN; i++)
+		sprintf(manifest + i * 2, "%02x", digest[i]);
+}
+
+/*** free_challenges ***/
+static void free_challenges(struct challenges * challenges) {
+	int i;
+
+	if (challenges->data != NULL) {
+		memset(challenges->data, 0, challenges->data_size);
+		free(challenges->data);
+	}
+
+	free(challenges->files);
+
+	if (challenges->index != NULL) {
+		memset(challenges->index, 0, challenges->index_size);
+		free(challenges->index);
 	}
 
-	while (1) {
-		path = strdup(CHALLENGEDIR + 1);
-		if (strstr(path + pathlength, "/") == NULL)
-			break;
+	for (i = 0; i < challenges->count; i++)
+		free(challenges->ents[i]);
+	free(challenges->ents);
+}
+
+/*** archive_path ***/
+static int archive_path(char * buffer, size_t size, const char * path, bool dir) {
+	size_t len;
 
-		*strstr(path + pathlength, "/") = 0;
-		pathlength = strlen(path) + 1;
+	/* Files go to the path they are read from on boot, with paths
+	 * overridden from environment too. No leading slash in archive,
+	 * a directory gets exactly one trailing slash. */
+	path += strspn(path, "/");
+	for (len = strlen(path); len > 0 && path[len - 1] == '/'; len--);
 
-		if (add_dir(archive, path) < 0) {
+	if (len == 0 || snprintf(buffer, size, "%.*s%s", (int) len, path,
+				dir == true ? "/" : "") >= size) {
+		fprintf(stderr, "Invalid path in archive: %s\n", path);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*** write_challenges ***/
+static int write_challenges(struct archive * archive, const struct challenges * challenges) {
+	int8_t rc = EXIT_FAILURE;
+	struct archive_entry * entry;
+	const struct file * file;
+	char path[PATH_MAX], * slash;
+	unsigned int i;
+	size_t prefix;
+
+	/* add the directories, without leading slash */
+	if (archive_path(path, sizeof(path), YKFDE_CHALLENGEDIR, true) != EXIT_SUCCESS)
+		goto out10;
+	for (slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+		*slash = 0;
+		if (add_dir(archive, path) != EXIT_SUCCESS) {
 			fprintf(stderr, "add_dir() failed");
 			goto out10;
 		}
-
-		free(path);
+		*slash = '/';
 	}
 
-	if ((dir = opendir(CHALLENGEDIR)) == NULL) {
-		perror("opendir() failed");
+	if ((entry = archive_entry_new()) == NULL) {
+		fprintf(stderr, "archive_entry_new() failed.\n");
 		goto out10;
 	}
 
-	while ((ent = readdir(dir)) != NULL) {
-		filename = malloc(sizeof(CHALLENGEDIR) + strlen(ent->d_name) + 1);
-		sprintf(filename, CHALLENGEDIR "%s", ent->d_name);
+	/* the path buffer is reused, only the file name is replaced */
+	prefix = strlen(path);
 
-		if (stat(filename, &st) < 0) {
-			perror("stat() failed");
-			goto out10;
+	for (i = 0; i < challenges->nfiles; i++) {
+		file = &challenges->files[i];
+
+		if (prefix + strlen(file->name) + 1 > sizeof(path)) {
+			fprintf(stderr, "File name too long.\n");
+			goto out20;
+		}
+		strcpy(path + prefix, file->name);
+
+		/* these do not return exit code */
+		archive_entry_clear(entry);
+		archive_entry_copy_pathname(entry, path);
+		archive_entry_set_size(entry, file->size);
+		archive_entry_set_filetype(entry, AE_IFREG);
+		archive_entry_set_perm(entry, 0644);
+
+		PROBE2(write__start, file->name, file->size);
+		if (archive_write_header(archive, entry) != ARCHIVE_OK) {
+			fprintf(stderr, "archive_write_header() failed");
+			goto out20;
 		}
 
-		if (S_ISREG(st.st_mode)) {
-			if ((entry = archive_entry_new()) == NULL) {
-				fprintf(stderr, "archive_entry_new() failed.\n");
-				goto out10;
-			}
+		/* the content goes from buffer in one go */
+		if (file->size > 0 &&
+				archive_write_data(archive, challenges->data + file->offset, file->size) < 0) {
+			fprintf(stderr, "archive_write_data() failed");
+			goto out20;
+		}
+		PROBE1(write__done, file->name);
+	}
 
-			/* these do not return exit code */
-			archive_entry_set_pathname(entry, filename + 1);
-			archive_entry_set_size(entry, st.st_size);
-			archive_entry_set_filetype(entry, AE_IFREG);
-			archive_entry_set_perm(entry, 0644);
+	/* the index goes last */
+	if (archive_path(path, sizeof(path), YKFDE_INDEXFILE, false) != EXIT_SUCCESS)
+		goto out20;
+	archive_entry_clear(entry);
+	archive_entry_copy_pathname(entry, path);
+	archive_entry_set_size(entry, challenges->index_size);
+	archive_entry_set_filetype(entry, AE_IFREG);
+	archive_entry_set_perm(entry, 0644);
 
-			if (archive_write_header(archive, entry) != ARCHIVE_OK) {
-				fprintf(stderr, "archive_write_header() failed");
-				goto out10;
-			}
+	if (archive_write_header(archive, entry) != ARCHIVE_OK) {
+		fprintf(stderr, "archive_write_header() failed");
+		goto out20;
+	}
 
-			if ((fdfile = open(filename, O_RDONLY)) < 0) {
-				perror("open() failed");
-				goto out10;
-			}
+	if (archive_write_data(archive, challenges->index, challenges->index_size) < 0) {
+		fprintf(stderr, "archive_write_data() failed");
+		goto out20;
+	}
 
-			if ((len = read(fdfile, buff, sizeof(buff))) < 0) {
-				perror("read() failed");
-				goto out10;
-			}
+	rc = EXIT_SUCCESS;
+
+out20:
+	archive_entry_free(entry);
+
+out10:
+	return rc;
+}
+
+/*** new_archive ***/
+static struct archive * new_archive(const struct filter * filter, int level) {
+	struct archive * archive;
+	char level_str[12], command[64];
+	int rc;
+
+	level = filter_level(filter, level);
+
+	if ((archive = archive_write_new()) == NULL) {
+		fprintf(stderr, "archive_write_new() failed.\n");
+		return NULL;
+	}
+
+	if (archive_write_set_format_cpio_newc(archive) != ARCHIVE_OK) {
+		fprintf(stderr, "archive_write_set_format_cpio_newc() failed.\n");
+		goto error;
+	}
+
+	if (filter->program != NULL) {
+		if (level >= 0)
+			snprintf(command, sizeof(command), "%s -%d", filter->program, level);
+		else
+			snprintf(command, sizeof(command), "%s", filter->program);
+		rc = archive_write_add_filter_program(archive, command);
+	} else
+		rc = filter->add(archive);
+	if (rc != ARCHIVE_OK) {
+		fprintf(stderr, "Failed adding filter %s: %s\n", filter->name, archive_error_string(archive));
+		goto error;
+	}
+
+	if (filter->program == NULL && level >= 0) {
+		snprintf(level_str, sizeof(level_str), "%d", level);
+		if (archive_write_set_filter_option(archive, NULL, "compression-level", level_str) != ARCHIVE_OK) {
+			fprintf(stderr, "Failed setting compression level %d: %s\n", level, archive_error_string(archive));
+			goto error;
+		}
+	}
+
+	return archive;
+
+error:
+	archive_write_free(archive);
+
+	return NULL;
+}
 
-			while (len > 0) {
-				if (archive_write_data(archive, buff, len) < 0) {
-					fprintf(stderr, "archive_write_data() failed");
-					goto out10;
-				}
+/*** bench ***/
+static int bench(const struct challenges * challenges, const int level, const bool json) {
+	int8_t rc = EXIT_FAILURE;
+	const struct filter * filter;
+	struct archive * archive;
+	struct archive_entry * entry;
+	char * buffer, data[4096];
+	size_t size, used;
+	uint64_t start, pack, unpack;
+	unsigned int runs;
+
+	/* headers, names and padding, plus trailer and last block */
+	size = challenges->data_len + challenges->index_size + (challenges->nfiles + 1) * (110 + NAME_MAX + strlen(YKFDE_CHALLENGEDIR) + 8) + 64 * 1024;
+	if ((buffer = malloc(size)) == NULL) {
+		perror("malloc() failed");
+		return rc;
+	}
 
-				if ((len = read(fdfile, buff, sizeof(buff))) < 0) {
-					perror("read() failed");
-					goto out10;
-				}
+	if (json == true)
+		printf("{\n\t\"challenges\": %u,\n\t\"codecs\": [", challenges->nfiles);
+	else
+		printf("%-8s %6s %12s %12s %12s\n", "codec", "level", "size", "pack", "unpack");
+
+	for (filter = filters; filter->name != NULL; filter++) {
+		pack = unpack = 0;
+
+		for (runs = 0; runs < BENCH_RUNS || pack + unpack < BENCH_USEC; runs++) {
+			start = now_usec();
+			if ((archive = new_archive(filter, level)) == NULL)
+				goto out;
+			if (archive_write_open_memory(archive, buffer, size, &used) != ARCHIVE_OK ||
+					write_challenges(archive, challenges) != EXIT_SUCCESS ||
+					archive_write_close(archive) != ARCHIVE_OK) {
+				fprintf(stderr, "Failed writing archive with %s: %s\n", filter->name, archive_error_string(archive));
+				archive_write_free(archive);
+				goto out;
 			}
+			archive_write_free(archive);
+			pack += now_usec() - start;
 
-			if (close(fdfile) < 0) {
-				perror("close() failed");
-				goto out10;
+			start = now_usec();
+			if ((archive = archive_read_new()) == NULL) {
+				fprintf(stderr, "archive_read_new() failed.\n");
+				goto out;
+			}
+			archive_read_support_filter_all(archive);
+			archive_read_support_format_cpio(archive);
+			if (archive_read_open_memory(archive, buffer, used) != ARCHIVE_OK) {
+				fprintf(stderr, "Failed reading archive with %s: %s\n", filter->name, archive_error_string(archive));
+				archive_read_free(archive);
+				goto out;
 			}
+			while (archive_read_next_header(archive, &entry) == ARCHIVE_OK)
+				while (archive_read_data(archive, data, sizeof(data)) > 0);
+			archive_read_free(archive);
+			unpack += now_usec() - start;
+		}
+
+		if (json == true)
+			printf("%s\n\t\t{ \"codec\": \"%s\", \"level\": %d, \"size\": %zu, \"runs\": %u, "
+					"\"pack_usec\": %" PRIu64 ", \"unpack_usec\": %" PRIu64 " }",
+					filter == filters ? "" : ",", filter->name, filter_level(filter, level),
+					used, runs, pack / runs, unpack / runs);
+		else
+			printf("%-8s %6d %12zu %9.3f ms %9.3f ms\n", filter->name, filter_level(filter, level),
+					used, pack / 1000.0 / runs, unpack / 1000.0 / runs);
+	}
+
+	if (json == true)
+		printf("\n\t]\n}\n");
+
+	rc = EXIT_SUCCESS;
+
+out:
+	memset(buffer, 0, size);
+	free(buffer);
+	memset(data, 0, sizeof(data));
+
+	return rc;
+}
+
+/*** check_manifest ***/
+static int check_manifest(const char * cpiofile, const char * manifest) {
+	char stored[SHA1_HASHLEN * 2 + 1], manifestname[PATH_MAX];
+	FILE * manifestfile;
+	int match = 0;
+
+	/* the archive has to be there */
+	if (access(cpiofile, F_OK) < 0)
+		return 0;
+
+	snprintf(manifestname, sizeof(manifestname), "%s" CPIOMANIFESTSUFFIX, cpiofile);
+	if ((manifestfile = fopen(manifestname, "r")) == NULL)
+		return 0;
+
+	if (fscanf(manifestfile, "%40s", stored) == 1)
+		match = (strcmp(stored, manifest) == 0);
+
+	fclose(manifestfile);
+
+	return match;
+}
+
+/*** write_manifest ***/
+static int write_manifest(const char * cpiofile, const char * manifest) {
+	char manifestname[PATH_MAX], manifesttmpfile[PATH_MAX];
+	int fd;
+
+	snprintf(manifestname, sizeof(manifestname), "%s" CPIOMANIFESTSUFFIX, cpiofile);
+	snprintf(manifesttmpfile, sizeof(manifesttmpfile), "%s" CPIOMANIFESTSUFFIX CPIOTMPSUFFIX, cpiofile);
+
+	if ((fd = mkstemp(manifesttmpfile)) < 0) {
+		perror("mkstemp() failed");
+		return EXIT_FAILURE;
+	}
+
+	if (dprintf(fd, "%s\n", manifest) < 0 || fchmod(fd, 0644) < 0 || close(fd) < 0) {
+		perror("Failed writing manifest");
+		unlink(manifesttmpfile);
+		return EXIT_FAILURE;
+	}
+
+	if (rename(manifesttmpfile, manifestname) < 0) {
+		perror("rename() failed");
+		unlink(manifesttmpfile);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+	int i, level = -1;
+	unsigned int bench_mode = 0, force = 0, json = 0, version = 0, help = 0;
+	const char * compression = NULL;
+	const struct filter * filter;
+	/* iniparser */
+	dictionary * ini;
+	const char * cpiofile;
+	char cpiotmpfile[PATH_MAX];
+	char manifest[SHA1_HASHLEN * 2 + 1];
+	struct challenges challenges;
+	struct archive *archive;
+	int fdarchive;
+	int8_t rc = EXIT_FAILURE;
 
-			archive_entry_free(entry);
+	/* get command line options */
+	while ((i = getopt_long(argc, argv, optstring, options_long, NULL)) != -1)
+		switch (i) {
+			case 'b':
+				bench_mode++;
+				break;
+			case 'c':
+				compression = optarg;
+				break;
+			case 'f':
+				force++;
+				break;
+			case 'l':
+				level = atoi(optarg);
+				break;
+			case 'h':
+				help++;
+				break;
+			case 'j':
+				json++;
+				break;
+			case 'V':
+				version++;
+				break;
 		}
-		free(filename);
+
+	if (version > 0)
+		printf("%s: %s v%s (compiled: " __DATE__ ", " __TIME__ ")\n", argv[0], PROGNAME, VERSION);
+
+	if (help > 0)
+		fprintf(stderr, "usage: %s [-b|--bench] [-c|--compression <none|gzip|xz|zstd>] [-l|--level <level>]\n"
+				"        [-f|--force] [-h|--help] [-j|--json] [-V|--version]\n", argv[0]);
+
+	if (version > 0 || help > 0)
+		return EXIT_SUCCESS;
+
+	/* the archive may be written elsewhere, for testing */
+	cpiofile = YKFDE_CPIOFILE;
+	if (snprintf(cpiotmpfile, sizeof(cpiotmpfile), "%s" CPIOTMPSUFFIX, cpiofile) >= sizeof(cpiotmpfile)) {
+		fprintf(stderr, "Path %s is too long.\n", cpiofile);
+		return EXIT_FAILURE;
+	}
+
+	memset(&challenges, 0, sizeof(struct challenges));
+
+	/* command line overrides config file,
+	 * which is optional here */
+	if ((ini = iniparser_load(YKFDE_CONFIGFILE)) != NULL) {
+		if (compression == NULL)
+			compression = iniparser_getstring(ini, "general:" CONFCOMPRESSION, NULL);
+		if (level < 0)
+			level = iniparser_getint(ini, "general:" CONFCOMPRESSIONLEVEL, level);
+	}
+
+	if ((filter = get_filter(compression ? compression : "none")) == NULL)
+		goto out05;
+
+	/* read challenges and compile the index,
+	 * skip regeneration if nothing changed */
+	if (read_challenges(&challenges) != EXIT_SUCCESS)
+		goto out10;
+
+	if (build_index(&challenges, ini) != EXIT_SUCCESS)
+		goto out10;
+
+	get_manifest(&challenges, filter, level, manifest);
+
+	if (bench_mode > 0) {
+		rc = bench(&challenges, level, json > 0);
+		goto out10;
+	}
+
+	if (force == 0 && check_manifest(cpiofile, manifest) > 0) {
+		rc = EXIT_SUCCESS;
+		goto out10;
 	}
 
-	if (closedir(dir) < 0) {
-		perror("closedir() failed");
+	if ((fdarchive = mkstemp(cpiotmpfile)) < 0) {
+		perror("mkstemp() failed");
 		goto out10;
 	}
 
+	if ((archive = new_archive(filter, level)) == NULL)
+		goto out20;
+
+	if (archive_write_open_fd(archive, fdarchive) != ARCHIVE_OK) {
+		fprintf(stderr, "archive_write_open_fd() failed.\n");
+		goto out30;
+	}
+
+	if (write_challenges(archive, &challenges) != EXIT_SUCCESS)
+		goto out30;
+
 	if (archive_write_close(archive) != ARCHIVE_OK) {
 		fprintf(stderr, "archive_write_close() failed");
-		goto out10;
+		goto out30;
 	}
 
 	if (archive_write_free(archive) != ARCHIVE_OK) {
 		fprintf(stderr, "archive_write_free() failed");
+		goto out20;
+	}
+	archive = NULL;
+
+	if (close(fdarchive) < 0) {
+		perror("close() failed");
 		goto out10;
 	}
+	fdarchive = -1;
 
-	if (access(CPIOFILE, F_OK) == 0 && unlink(CPIOFILE) < 0) {
+	if (access(cpiofile, F_OK) == 0 && unlink(cpiofile) < 0) {
 		perror("unkink() failed");
 		goto out10;
 	}
 
-	if (rename(cpiotmpfile, CPIOFILE) < 0) {
+	if (rename(cpiotmpfile, cpiofile) < 0) {
 		perror("rename() failed");
 		goto out10;
 	}
 
+	if (write_manifest(cpiofile, manifest) != EXIT_SUCCESS)
+		goto out10;
+
 	rc = EXIT_SUCCESS;
 
+out30:
+	if (archive != NULL)
+		archive_write_free(archive);
+
+out20:
+	if (fdarchive >= 0)
+		close(fdarchive);
+
 out10:
+	free_challenges(&challenges);
+
+out05:
+	/* free iniparser dictionary, compression points into it */
+	if (ini != NULL)
+		iniparser_freedict(ini);
+
 	if (access(cpiotmpfile, F_OK) == 0)
 		unlink(cpiotmpfile);
 
@@ -18,59 +18,117 @@
 
 #define _GNU_SOURCE
 
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/random.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <systemd/sd-daemon.h>
 
 #include <iniparser/iniparser.h>
 
-#include <keyutils.h>
+#include <json-c/json.h>
 
-#include <yubikey.h>
-#include <ykpers-1/ykdef.h>
-#include <ykpers-1/ykcore.h>
+#include <keyutils.h>
 
 #include <libcryptsetup.h>
 
 #include "../config.h"
 #include "../version.h"
+#include "libykfde.h"
+#include "probes.h"
+#include "token.h"
 
 #define PROGNAME "ykfde"
 
-/* Yubikey supports write of 64 byte challenge to slot, returns
- * HMAC-SHA1 response.
- *
- * Lengths are defined in ykpers-1/ykdef.h:
- * SHA1_MAX_BLOCK_SIZE	64
- * SHA1_DIGEST_SIZE	20
- *
- * For passphrase we use hex encoded digest, that is twice the
- * length of binary digest. */
-#define CHALLENGELEN	SHA1_MAX_BLOCK_SIZE
-#define RESPONSELEN	SHA1_MAX_BLOCK_SIZE
-#define PASSPHRASELEN	SHA1_DIGEST_SIZE * 2
-#define MAX2FLEN	CHALLENGELEN / 2
-
-const static char optstring[] = "hn:Ns:SV";
+#define CHALLENGELEN	YKFDE_CHALLENGELEN
+#define PASSPHRASELEN	YKFDE_PASSPHRASELEN
+
+/* maximum number of keys handled in one run */
+#define KEYS_MAX	8
+
+/* minimum iterations libcryptsetup accepts for pbkdf2 */
+#define PBKDF2_MIN_ITER	1000
+
+/* the challenge directory may be given at runtime */
+#define CHALLENGEFILELEN	PATH_MAX
+#define CHALLENGEFILETMPLEN	PATH_MAX + 7 /* -XXXXXX */
+
+/* backends compared with --bench, and how often */
+#define BENCH_BACKENDS	{ "ykpers", "hidraw" }
+#define BENCH_RUNS	10
+
+const static char optstring[] = "abhjn:Ns:StV";
 const static struct option options_long[] = {
 	/* name			has_arg			flag	val */
+	{ "all",		no_argument,		NULL,	'a' },
+	{ "bench",		no_argument,		NULL,	'b' },
 	{ "help",		no_argument,		NULL,	'h' },
+	{ "json",		no_argument,		NULL,	'j' },
 	{ "2nd-factor",		required_argument,	NULL,	's' },
 	{ "ask-2nd-factor",	no_argument,		NULL,	'S' },
 	{ "new-2nd-factor",	required_argument,	NULL,	'n' },
 	{ "ask-new-2nd-factor",	no_argument,		NULL,	'N' },
+	{ "scheduled",		no_argument,		NULL,	't' },
 	{ "version",		no_argument,		NULL,	'V' },
 	{ 0, 0, 0, 0 }
 };
 
+enum task {
+	TASK_PENDING = 0,
+	TASK_RUNNING,
+	TASK_DONE,
+};
+
+/* a LUKS device to update for a key */
+struct device {
+	const char * name;
+	crypt_keyslot_info keyslot;
+	struct crypt_pbkdf_type pbkdf;
+	bool pbkdf_set;
+	bool token;
+	bool second_factor;
+	bool derive;
+	enum task task;
+	pid_t pid;
+	int rc;
+};
+
+/* an attached and enrolled key, with all its devices */
+struct key {
+	struct ykfde_session session;
+	bool active;
+	struct device devices[YKFDE_DEVICES_MAX];
+	unsigned int devices_count;
+	char challenge_old[CHALLENGELEN + 1],
+		challenge_new[CHALLENGELEN + 1],
+		passphrase_old[PASSPHRASELEN + 1],
+		passphrase_new[PASSPHRASELEN + 1];
+	char challengefilename[CHALLENGEFILELEN],
+		challengefiletmpname[CHALLENGEFILETMPLEN];
+};
+
+static struct key keys[KEYS_MAX];
+static unsigned int keys_count = 0;
+
+/* report timings as JSON, one object per line */
+static bool json = false;
+
+/*** ask_secret ***/
 char * ask_secret(const char * text) {
 	struct termios tp, tp_save;
 	char * factor = NULL;
@@ -110,47 +168,939 @@ char * ask_secret(const char * text) {
 	return factor;
 }
 
+/*** now_usec ***/
+static uint64_t now_usec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*** get_pbkdf ***/
+static int get_pbkdf(unsigned int serial, struct device * device) {
+	const struct crypt_pbkdf_type * pbkdf;
+	const char * type, * iterations, * memory, * parallel;
+
+	type = ykfde_get_config(serial, device->name, CONFPBKDF);
+	iterations = ykfde_get_config(serial, device->name, CONFPBKDFITER);
+	memory = ykfde_get_config(serial, device->name, CONFPBKDFMEMORY);
+	parallel = ykfde_get_config(serial, device->name, CONFPBKDFPARALLEL);
+
+	/* Nothing configured, the passphrase is a random response of
+	 * 160 bit. The cheapest pbkdf libcryptsetup accepts is fine. */
+	if (type == NULL && iterations == NULL && memory == NULL && parallel == NULL) {
+		device->pbkdf = (struct crypt_pbkdf_type) {
+			.type = CRYPT_KDF_PBKDF2,
+			.hash = "sha512",
+			.iterations = PBKDF2_MIN_ITER,
+			.flags = CRYPT_PBKDF_NO_BENCHMARK,
+		};
+		device->pbkdf_set = true;
+		return EXIT_SUCCESS;
+	}
+
+	if ((pbkdf = crypt_get_pbkdf_default(CRYPT_LUKS2)) == NULL) {
+		fprintf(stderr, "Failed to get default pbkdf.\n");
+		return EXIT_FAILURE;
+	}
+	device->pbkdf = *pbkdf;
+
+	if (type == NULL) {
+		/* keep default type */
+	} else if (strcmp(type, CRYPT_KDF_PBKDF2) == 0) {
+		device->pbkdf.type = CRYPT_KDF_PBKDF2;
+	} else if (strcmp(type, CRYPT_KDF_ARGON2I) == 0) {
+		device->pbkdf.type = CRYPT_KDF_ARGON2I;
+	} else if (strcmp(type, CRYPT_KDF_ARGON2ID) == 0) {
+		device->pbkdf.type = CRYPT_KDF_ARGON2ID;
+	} else {
+		fprintf(stderr, "Unknown pbkdf '%s' for device %s.\n", type, device->name);
+		return EXIT_FAILURE;
+	}
+
+	/* the passphrase is a random response, no need to
+	 * benchmark for a cost that protects a human password */
+	if (iterations != NULL && (device->pbkdf.iterations = strtoul(iterations, NULL, 10)) > 0)
+		device->pbkdf.flags |= CRYPT_PBKDF_NO_BENCHMARK;
+
+	if (strcmp(device->pbkdf.type, CRYPT_KDF_PBKDF2) == 0) {
+		device->pbkdf.max_memory_kb = 0;
+		device->pbkdf.parallel_threads = 0;
+	} else {
+		if (memory != NULL)
+			device->pbkdf.max_memory_kb = strtoul(memory, NULL, 10);
+		if (parallel != NULL)
+			device->pbkdf.parallel_threads = strtoul(parallel, NULL, 10);
+	}
+
+	device->pbkdf_set = true;
+
+	return EXIT_SUCCESS;
+}
+
+/*** get_devices ***/
+static int get_devices(dictionary * ini, struct key * key) {
+	struct device * device;
+	const char * tmp;
+	unsigned int i;
+
+	if (key->session.devices_count == 0) {
+		/* read from crypttab? */
+		/* get device from currently open devices? */
+		fprintf(stderr, "Could not read LUKS device from configuration file.\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < key->session.devices_count; i++) {
+		device = &key->devices[i];
+		device->name = key->session.devices[i];
+		device->rc = EXIT_FAILURE;
+		if (get_pbkdf(key->session.serial, device) != EXIT_SUCCESS)
+			return EXIT_FAILURE;
+		/* same as iniparser_getboolean(), but with lookup in sections */
+		if ((tmp = ykfde_get_config(key->session.serial, device->name, CONFLUKSTOKEN)) != NULL &&
+				*tmp != '\0' && strchr("yYtT1", *tmp) != NULL)
+			device->token = true;
+		device->second_factor = iniparser_getboolean(ini, "general:" CONF2NDFACTOR, 0) > 0;
+		device->derive = iniparser_getboolean(ini, "general:" CONFDERIVE, 0) > 0;
+	}
+	key->devices_count = key->session.devices_count;
+
+	return EXIT_SUCCESS;
+}
+
+/*** enrolled ***/
+static bool enrolled(unsigned int serial) {
+	unsigned int i;
+
+	for (i = 0; i < keys_count; i++)
+		if (keys[i].session.serial == serial)
+			return true;
+
+	return false;
+}
+
+/*** rotated_recently ***/
+static bool rotated_recently(unsigned int serial, unsigned int interval) {
+	char challengefilename[CHALLENGEFILELEN];
+	struct stat st;
+
+	/* the challenge file is replaced on every rotation */
+	snprintf(challengefilename, CHALLENGEFILELEN, "%s/challenge-%d", YKFDE_CHALLENGEDIR, serial);
+	if (stat(challengefilename, &st) < 0)
+		return false;
+
+	return time(NULL) - st.st_mtime < (time_t) interval * 3600;
+}
+
+/*** open_keys ***/
+static int open_keys(dictionary * ini, bool all, unsigned int interval) {
+	const char * section;
+	char * end;
+	struct key * key;
+	unsigned long serial;
+	unsigned int skipped = 0;
+	int i, nsec;
+
+	for (i = 0; keys_count < KEYS_MAX; i++) {
+		key = &keys[keys_count];
+
+		if (ykfde_open(&key->session, i) != EXIT_SUCCESS)
+			break;
+
+		/* read the serial number and config for key */
+		if (ykfde_identify(&key->session) != EXIT_SUCCESS)
+			goto fail;
+
+		/* the luks slot is set for enrolled keys only */
+		if (key->session.luks_slot < 0) {
+			if (all == false) {
+				fprintf(stderr, "Please set LUKS key slot for Yubikey with serial %d!\n"
+						"Add something like this to %s:\n\n"
+						"[%d]\nluks slot = 1\n", key->session.serial, YKFDE_CONFIGFILE,
+						key->session.serial);
+				goto fail;
+			}
+
+			/* not enrolled, ignore in batch mode */
+			fprintf(stderr, "Yubikey with serial %d is not enrolled, skipping.\n", key->session.serial);
+			ykfde_close(&key->session);
+			continue;
+		}
+
+		/* scheduled rotation is skipped if the last one is recent */
+		if (interval > 0 && rotated_recently(key->session.serial, interval) == true) {
+			fprintf(stderr, "Challenge for Yubikey with serial %d was updated within %d hours, skipping.\n",
+					key->session.serial, interval);
+			ykfde_close(&key->session);
+			skipped++;
+			if (all == false)
+				break;
+			continue;
+		}
+
+		if (get_devices(ini, key) != EXIT_SUCCESS)
+			goto fail;
+
+		keys_count++;
+
+		/* without batch mode we handle the first key only */
+		if (all == false)
+			break;
+	}
+
+	/* nothing to do is fine */
+	if (keys_count == 0 && skipped > 0)
+		return EXIT_SUCCESS;
+
+	if (keys_count == 0) {
+		fprintf(stderr, "No Yubikey available.\n");
+		return EXIT_FAILURE;
+	}
+
+	/* a challenge can be updated only if its key is attached */
+	if (all == true) {
+		nsec = iniparser_getnsec(ini);
+		for (i = 0; i < nsec; i++) {
+			if ((section = iniparser_getsecname(ini, i)) == NULL)
+				continue;
+			serial = strtoul(section, &end, 10);
+			if (*section == '\0' || *end != '\0' || enrolled(serial) == true ||
+					(interval > 0 && rotated_recently(serial, interval) == true))
+				continue;
+			fprintf(stderr, "Yubikey with serial %s is not attached, skipping.\n", section);
+		}
+	}
+
+	return EXIT_SUCCESS;
+
+fail:
+	/* the failed key is not counted, close it here */
+	ykfde_close(&key->session);
+
+	return EXIT_FAILURE;
+}
+
+/*** close_keys ***/
+static void close_keys(void) {
+	unsigned int i;
+
+	for (i = 0; i < keys_count; i++) {
+		ykfde_close(&keys[i].session);
+
+		/* remove challenge file that did not go live */
+		if (*keys[i].challengefiletmpname != '\0' &&
+				access(keys[i].challengefiletmpname, F_OK) == 0)
+			unlink(keys[i].challengefiletmpname);
+	}
+
+	/* wipe challenges and passphrases from memory */
+	memset(keys, 0, sizeof(keys));
+	keys_count = 0;
+}
+
+/*** get_passphrase ***/
+static int get_passphrase(struct key * key, char * challenge,
+		const char * second_factor, char * passphrase) {
+	/* add second factor to challenge */
+	ykfde_second_factor(challenge, second_factor, strlen(second_factor));
+
+	/* do challenge/response and encode to hex */
+	return ykfde_challenge_response(&key->session, challenge, passphrase);
+}
+
+/*** write_challenges ***/
+static int write_challenges(void) {
+	unsigned int challenge_int[CHALLENGELEN];
+	struct key * key;
+	unsigned int i, j;
+	size_t len;
+	int fd, rc = EXIT_FAILURE;
+
+	for (i = 0; i < keys_count; i++) {
+		key = &keys[i];
+
+		/* get random number - try random first, fall back to urandom
+		   We generate an array of unsigned int, the use modulo to limit to printable
+		   ASCII characters (32 to 127). */
+		if ((len = getrandom(challenge_int, CHALLENGELEN * sizeof(unsigned int), GRND_RANDOM|GRND_NONBLOCK)) != CHALLENGELEN * sizeof(unsigned int))
+			len += getrandom((void *)((size_t)challenge_int + len), CHALLENGELEN * sizeof(unsigned int) - len, 0);
+		for (j = 0; j < CHALLENGELEN; j++)
+			key->challenge_new[j] = (challenge_int[j] % (127 - 32)) + 32;
+
+		/* these are the filenames for challenge
+		 * we need this for reading and writing */
+		snprintf(key->challengefilename, CHALLENGEFILELEN, "%s/challenge-%d",
+				YKFDE_CHALLENGEDIR, key->session.serial);
+		snprintf(key->challengefiletmpname, CHALLENGEFILETMPLEN, "%s-XXXXXX", key->challengefilename);
+
+		/* write new challenge to file */
+		if ((fd = mkstemp(key->challengefiletmpname)) < 0) {
+			fprintf(stderr, "Could not open file %s for writing.\n", key->challengefiletmpname);
+			*key->challengefiletmpname = '\0';
+			goto out;
+		}
+		if (write(fd, key->challenge_new, CHALLENGELEN) < 0) {
+			fprintf(stderr, "Failed to write challenge to file.\n");
+			close(fd);
+			goto out;
+		}
+		close(fd);
+	}
+
+	/* sync all new challenges to disk at once */
+	if ((fd = open(YKFDE_CHALLENGEDIR, O_RDONLY | O_DIRECTORY)) < 0) {
+		perror("Failed opening challenge directory");
+		goto out;
+	}
+	if (syncfs(fd) < 0) {
+		fprintf(stderr, "Failed to sync files to disk.\n");
+		close(fd);
+		goto out;
+	}
+	close(fd);
+
+	rc = EXIT_SUCCESS;
+
+out:
+	memset(challenge_int, 0, CHALLENGELEN * sizeof(unsigned int));
+
+	return rc;
+}
+
+/*** check_devices ***/
+static int check_devices(struct key * key, bool * inactive) {
+	struct crypt_device * cryptdevice;
+	crypt_status_info cryptstatus;
+	struct device * device;
+	unsigned int i;
+
+	for (i = 0; i < key->devices_count; i++) {
+		device = &key->devices[i];
+
+		/* get status of crypt device
+		 * We expect this to be active (or busy). It is the actual root device, no? */
+		cryptstatus = crypt_status(NULL, device->name);
+		if (cryptstatus != CRYPT_ACTIVE && cryptstatus != CRYPT_BUSY) {
+			fprintf(stderr, "Device %s is invalid or inactive.\n", device->name);
+			return EXIT_FAILURE;
+		}
+
+		/* initialize crypt device */
+		PROBE1(cryptinit__start, device->name);
+		if (crypt_init_by_name(&cryptdevice, device->name) < 0) {
+			PROBE2(cryptinit__done, device->name, 0);
+			fprintf(stderr, "Device %s failed to initialize.\n", device->name);
+			return EXIT_FAILURE;
+		}
+		PROBE2(cryptinit__done, device->name, 1);
+
+		device->keyslot = crypt_keyslot_status(cryptdevice, key->session.luks_slot);
+		crypt_free(cryptdevice);
+
+		switch (device->keyslot) {
+			case CRYPT_SLOT_ACTIVE:
+			case CRYPT_SLOT_ACTIVE_LAST:
+				key->active = true;
+				break;
+			case CRYPT_SLOT_INACTIVE:
+				*inactive = true;
+				break;
+			default:
+				fprintf(stderr, "Key slot %d is invalid on device %s.\n",
+						key->session.luks_slot, device->name);
+				return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*** token_serial ***/
+static unsigned int token_serial(struct crypt_device * cryptdevice, int token) {
+	json_object * root, * obj;
+	unsigned int serial = 0;
+	const char * json;
+
+	if (crypt_token_json_get(cryptdevice, token, &json) < 0 ||
+			(root = json_tokener_parse(json)) == NULL)
+		return 0;
+
+	if (json_object_object_get_ex(root, TOKENSERIAL, &obj) != 0 &&
+			json_object_is_type(obj, json_type_int) != 0)
+		serial = json_object_get_int64(obj);
+
+	json_object_put(root);
+
+	return serial;
+}
+
+/*** write_token ***/
+static int write_token(struct crypt_device * cryptdevice, struct key * key, struct device * device) {
+	char json[sizeof(TOKENJSON) + 32];
+	const char * type;
+	int i, token, token_max;
+
+	/* tokens exist in LUKS2 only */
+	if ((type = crypt_get_type(cryptdevice)) == NULL || strcmp(type, CRYPT_LUKS2) != 0) {
+		fprintf(stderr, "Device %s is not LUKS2, can not add token.\n", device->name);
+		return EXIT_FAILURE;
+	}
+
+	/* Update the token for this key slot if there is one, or the
+	 * one for this key if the slot lost its assignment. Writing
+	 * the token assigns it to the slot again. */
+	token = CRYPT_ANY_TOKEN;
+	token_max = crypt_token_max(CRYPT_LUKS2);
+	for (i = 0; i < token_max; i++) {
+		if (crypt_token_status(cryptdevice, i, &type) < CRYPT_TOKEN_EXTERNAL ||
+				type == NULL || strcmp(type, TOKENTYPE) != 0)
+			continue;
+		if (crypt_token_is_assigned(cryptdevice, i, key->session.luks_slot) == 0) {
+			token = i;
+			break;
+		}
+		if (token == CRYPT_ANY_TOKEN && token_serial(cryptdevice, i) == key->session.serial)
+			token = i;
+	}
+
+	snprintf(json, sizeof(json), TOKENJSON, key->session.luks_slot, key->session.serial,
+			key->session.yk_slot == SLOT_CHAL_HMAC1 ? 1 : 2,
+			device->second_factor == true ? "true" : "false",
+			device->derive == true ? "true" : "false");
+
+	if ((token = crypt_token_json_set(cryptdevice, token, json)) < 0) {
+		fprintf(stderr, "Could not write token for key slot %d on device %s.\n",
+				key->session.luks_slot, device->name);
+		return EXIT_FAILURE;
+	}
+
+	printf("Token %d references key slot %d on device %s.\n",
+			token, key->session.luks_slot, device->name);
+
+	return EXIT_SUCCESS;
+}
+
+/*** device_passphrase ***/
+static const char * device_passphrase(struct crypt_device * cryptdevice,
+		const struct device * device, const char * passphrase, char * derived) {
+	/* every device has its own passphrase, derived from response */
+	if (device->derive == false)
+		return passphrase;
+
+	if (ykfde_derive_passphrase(passphrase, crypt_get_uuid(cryptdevice), derived) != EXIT_SUCCESS)
+		return NULL;
+
+	return derived;
+}
+
+/*** change_keyslot ***/
+static int change_keyslot(struct crypt_device * cryptdevice, int keyslot,
+		const char * passphrase_old, const char * passphrase_alt,
+		const char * passphrase_new) {
+	int r;
+
+	/* The slot is replaced in place, so no spare slot is needed and
+	 * its token stays assigned. That is one pbkdf with old cost to
+	 * unlock and one with the configured cost to write. LUKS2 writes
+	 * the new slot to free space before the header is switched. */
+	r = crypt_keyslot_change_by_passphrase(cryptdevice, keyslot, keyslot,
+			passphrase_old, PASSPHRASELEN, passphrase_new, PASSPHRASELEN);
+	/* the slot may not be enrolled with derived passphrase yet */
+	if (r == -EPERM && passphrase_alt != NULL)
+		r = crypt_keyslot_change_by_passphrase(cryptdevice, keyslot, keyslot,
+				passphrase_alt, PASSPHRASELEN, passphrase_new, PASSPHRASELEN);
+
+	return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*** update_keyslot ***/
+static int update_keyslot(struct key * key, struct device * device, const char * passphrase) {
+	struct crypt_device * cryptdevice;
+	struct crypt_pbkdf_type pbkdf;
+	struct rusage usage;
+	uint64_t start, update;
+	char derived_old[PASSPHRASELEN + 1], derived_new[PASSPHRASELEN + 1];
+	const char * passphrase_old, * passphrase_new;
+	int rc = EXIT_FAILURE;
+
+	if (crypt_init_by_name(&cryptdevice, device->name) < 0) {
+		fprintf(stderr, "Device %s failed to initialize.\n", device->name);
+		return EXIT_FAILURE;
+	}
+
+	/* the cost applies to the keyslot written below */
+	if (device->pbkdf_set == true &&
+			crypt_set_pbkdf_type(cryptdevice, &device->pbkdf) < 0) {
+		fprintf(stderr, "Failed to set pbkdf %s for device %s.\n",
+				device->pbkdf.type, device->name);
+		goto out;
+	}
+
+	if ((passphrase_new = device_passphrase(cryptdevice, device,
+			key->passphrase_new, derived_new)) == NULL ||
+			(passphrase_old = device_passphrase(cryptdevice, device,
+			key->passphrase_old, derived_old)) == NULL)
+		goto out;
+
+	PROBE1(keyslot__start, key->session.luks_slot);
+	start = now_usec();
+	if (device->keyslot == CRYPT_SLOT_INACTIVE) {
+		if (crypt_keyslot_add_by_passphrase(cryptdevice, key->session.luks_slot,
+				passphrase, strlen(passphrase),
+				passphrase_new, PASSPHRASELEN) < 0) {
+			PROBE2(keyslot__done, key->session.luks_slot, 0);
+			fprintf(stderr, "Could not add passphrase for key slot %d on device %s.\n",
+					key->session.luks_slot, device->name);
+			goto out;
+		}
+	} else {
+		if (change_keyslot(cryptdevice, key->session.luks_slot, passphrase_old,
+				device->derive == true ? key->passphrase_old : NULL,
+				passphrase_new) != EXIT_SUCCESS) {
+			PROBE2(keyslot__done, key->session.luks_slot, 0);
+			fprintf(stderr, "Could not update passphrase for key slot %d on device %s.\n",
+					key->session.luks_slot, device->name);
+			goto out;
+		}
+	}
+	update = now_usec() - start;
+	PROBE2(keyslot__done, key->session.luks_slot, 1);
+
+	/* The update includes unlock with the old passphrase, that is the
+	 * human one for a new slot. What unlock of the new slot costs is
+	 * given by its pbkdf, no need to run it again. */
+	memset(&pbkdf, 0, sizeof(pbkdf));
+	if (crypt_keyslot_get_pbkdf(cryptdevice, key->session.luks_slot, &pbkdf) < 0 || pbkdf.type == NULL)
+		pbkdf.type = "unknown";
+
+	getrusage(RUSAGE_SELF, &usage);
+	if (json == true)
+		printf("{ \"serial\": %u, \"device\": \"%s\", \"luks_slot\": %d, \"added\": %s, "
+				"\"update_usec\": %" PRIu64 ", \"pbkdf\": \"%s\", \"pbkdf_iterations\": %u, "
+				"\"pbkdf_memory_kib\": %u, \"cpu_usec\": %ld, \"memory_kib\": %ld }\n",
+				key->session.serial, device->name, key->session.luks_slot,
+				device->keyslot == CRYPT_SLOT_INACTIVE ? "true" : "false", update,
+				pbkdf.type, pbkdf.iterations, pbkdf.max_memory_kb,
+				(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+					usage.ru_utime.tv_usec + usage.ru_stime.tv_usec,
+				usage.ru_maxrss);
+	else
+		printf("Key slot %d on device %s: %s in %" PRIu64 " ms, pbkdf %s with %u iterations "
+				"and %u KiB, cpu %ld ms, memory %ld MiB.\n",
+				key->session.luks_slot, device->name,
+				device->keyslot == CRYPT_SLOT_INACTIVE ? "added" : "updated", update / 1000,
+				pbkdf.type, pbkdf.iterations, pbkdf.max_memory_kb,
+				(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000 +
+					(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000,
+				usage.ru_maxrss / 1024);
+
+	/* let systemd-cryptsetup unlock with our token plugin - the slot
+	 * holds the new passphrase now, so this is not fatal */
+	if (device->token == true && write_token(cryptdevice, key, device) != EXIT_SUCCESS)
+		fprintf(stderr, "Warning: Key slot %d on device %s is updated, but its token is not.\n",
+				key->session.luks_slot, device->name);
+
+	rc = EXIT_SUCCESS;
+
+out:
+	crypt_free(cryptdevice);
+	memset(derived_old, 0, PASSPHRASELEN + 1);
+	memset(derived_new, 0, PASSPHRASELEN + 1);
+
+	return rc;
+}
+
+/*** pool_size ***/
+static unsigned int pool_size(unsigned int tasks) {
+	const struct crypt_pbkdf_type * pbkdf;
+	unsigned long memavail = 0, memory = 0;
+	unsigned int i, j, size, threads = 1;
+	char line[128];
+	FILE * meminfo;
+	long cpus;
+
+	/* every keyslot update runs one pbkdf at a time, which takes
+	 * its configured threads and memory - size for the most
+	 * expensive one */
+	for (i = 0; i < keys_count; i++)
+		for (j = 0; j < keys[i].devices_count; j++) {
+			if (keys[i].devices[j].pbkdf_set == true)
+				pbkdf = &keys[i].devices[j].pbkdf;
+			else if ((pbkdf = crypt_get_pbkdf_default(CRYPT_LUKS2)) == NULL)
+				continue;
+			if (pbkdf->parallel_threads > threads)
+				threads = pbkdf->parallel_threads;
+			if (pbkdf->max_memory_kb > memory)
+				memory = pbkdf->max_memory_kb;
+		}
+
+	if ((cpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		cpus = 1;
+	size = cpus / threads;
+
+	if (memory > 0 && (meminfo = fopen("/proc/meminfo", "r")) != NULL) {
+		while (fgets(line, sizeof(line), meminfo) != NULL)
+			if (sscanf(line, "MemAvailable: %lu kB", &memavail) == 1)
+				break;
+		fclose(meminfo);
+
+		if (memavail > 0 && memavail / memory < size)
+			size = memavail / memory;
+	}
+
+	if (size > tasks)
+		size = tasks;
+
+	return size > 0 ? size : 1;
+}
+
+/*** device_busy ***/
+static bool device_busy(const char * name) {
+	unsigned int i, j;
+
+	for (i = 0; i < keys_count; i++)
+		for (j = 0; j < keys[i].devices_count; j++)
+			if (keys[i].devices[j].task == TASK_RUNNING &&
+					strcmp(keys[i].devices[j].name, name) == 0)
+				return true;
+
+	return false;
+}
+
+/*** reap_keyslot ***/
+static int reap_keyslot(void) {
+	struct device * device;
+	unsigned int i, j;
+	int status;
+	pid_t pid;
+
+	while ((pid = waitpid(-1, &status, 0)) < 0)
+		if (errno != EINTR) {
+			perror("waitpid() failed");
+			return EXIT_FAILURE;
+		}
+
+	for (i = 0; i < keys_count; i++)
+		for (j = 0; j < keys[i].devices_count; j++) {
+			device = &keys[i].devices[j];
+			if (device->task != TASK_RUNNING || device->pid != pid)
+				continue;
+			device->rc = WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+			device->task = TASK_DONE;
+			return EXIT_SUCCESS;
+		}
+
+	return EXIT_SUCCESS;
+}
+
+/*** update_keyslots ***/
+static void update_keyslots(const char * passphrase) {
+	struct device * device, * next;
+	struct key * key, * next_key;
+	unsigned int i, j, size, tasks = 0, pending, running = 0;
+	struct rusage usage;
+	uint64_t start;
+	pid_t pid;
+	int rc;
+
+	for (i = 0; i < keys_count; i++)
+		tasks += keys[i].devices_count;
+	size = pool_size(tasks);
+
+	/* libcryptsetup is not safe to use from several threads, so every
+	 * keyslot update runs in a process of its own */
+	fflush(stdout);
+	fflush(stderr);
+
+	start = now_usec();
+	for (pending = tasks; pending > 0 || running > 0; ) {
+		/* find a task whose device is not updated right now,
+		 * concurrent header writes to the same device would race */
+		next = NULL;
+		next_key = NULL;
+		if (running < size)
+			for (i = 0; i < keys_count && next == NULL; i++)
+				for (j = 0; j < keys[i].devices_count; j++) {
+					device = &keys[i].devices[j];
+					if (device->task == TASK_PENDING && device_busy(device->name) == false) {
+						next = device;
+						next_key = &keys[i];
+						break;
+					}
+				}
+
+		if (next == NULL) {
+			if (reap_keyslot() != EXIT_SUCCESS)
+				break;
+			running--;
+			continue;
+		}
+
+		key = next_key;
+		device = next;
+		pending--;
+
+		if ((pid = fork()) < 0) {
+			perror("fork() failed");
+			device->task = TASK_DONE;
+			continue;
+		} else if (pid == 0) {
+			rc = update_keyslot(key, device, passphrase);
+			/* _exit() does not flush, output may go to a pipe */
+			fflush(stdout);
+			_exit(rc);
+		}
+
+		device->pid = pid;
+		device->task = TASK_RUNNING;
+		running++;
+	}
+
+	/* what rotation cost in total, every update ran in a child */
+	if (getrusage(RUSAGE_CHILDREN, &usage) < 0)
+		return;
+
+	if (json == true)
+		printf("{ \"keyslots\": %u, \"total_usec\": %" PRIu64 ", \"cpu_usec\": %ld, "
+				"\"memory_kib\": %ld }\n", tasks, now_usec() - start,
+				(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+					usage.ru_utime.tv_usec + usage.ru_stime.tv_usec,
+				usage.ru_maxrss);
+	else
+		printf("Updating key slots took %" PRIu64 " ms, cpu %ld ms, memory %ld MiB at most.\n",
+				(now_usec() - start) / 1000,
+				(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000 +
+					(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000,
+				usage.ru_maxrss / 1024);
+}
+
+/*** rollback_keyslots ***/
+static int rollback_keyslots(struct key * key) {
+	struct crypt_device * cryptdevice;
+	struct device * device;
+	int rc = EXIT_SUCCESS;
+	char derived_old[PASSPHRASELEN + 1], derived_new[PASSPHRASELEN + 1];
+	const char * passphrase_old, * passphrase_new;
+	unsigned int i;
+
+	for (i = 0; i < key->devices_count; i++) {
+		device = &key->devices[i];
+		if (device->rc != EXIT_SUCCESS)
+			continue;
+
+		if (crypt_init_by_name(&cryptdevice, device->name) < 0) {
+			fprintf(stderr, "Device %s failed to initialize.\n", device->name);
+			rc = EXIT_FAILURE;
+			continue;
+		}
+
+		if (device->pbkdf_set == true)
+			crypt_set_pbkdf_type(cryptdevice, &device->pbkdf);
+
+		/* restore the old passphrase, or drop the slot we added */
+		if (device->keyslot == CRYPT_SLOT_INACTIVE) {
+			if (crypt_keyslot_destroy(cryptdevice, key->session.luks_slot) < 0) {
+				fprintf(stderr, "Could not remove key slot %d on device %s.\n",
+						key->session.luks_slot, device->name);
+				rc = EXIT_FAILURE;
+			}
+		} else if ((passphrase_new = device_passphrase(cryptdevice, device,
+				key->passphrase_new, derived_new)) == NULL ||
+				(passphrase_old = device_passphrase(cryptdevice, device,
+				key->passphrase_old, derived_old)) == NULL ||
+				change_keyslot(cryptdevice, key->session.luks_slot, passphrase_new, NULL,
+				passphrase_old) != EXIT_SUCCESS) {
+			fprintf(stderr, "Could not restore passphrase for key slot %d on device %s.\n",
+					key->session.luks_slot, device->name);
+			rc = EXIT_FAILURE;
+		}
+
+		crypt_free(cryptdevice);
+	}
+
+	memset(derived_old, 0, PASSPHRASELEN + 1);
+	memset(derived_new, 0, PASSPHRASELEN + 1);
+
+	return rc;
+}
+
+/*** commit_challenges ***/
+static int commit_challenges(unsigned int * committed) {
+	struct key * key;
+	unsigned int i, j;
+	int fd, rc = EXIT_SUCCESS;
+
+	for (i = 0; i < keys_count; i++) {
+		key = &keys[i];
+
+		for (j = 0; j < key->devices_count; j++)
+			if (key->devices[j].rc != EXIT_SUCCESS)
+				break;
+
+		/* keep the old challenge if any device failed */
+		if (j < key->devices_count) {
+			fprintf(stderr, "Updating Yubikey with serial %d failed, rolling back.\n", key->session.serial);
+			rc = EXIT_FAILURE;
+			if (rollback_keyslots(key) == EXIT_SUCCESS)
+				continue;
+		} else if (rename(key->challengefiletmpname, key->challengefilename) == 0) {
+			*key->challengefiletmpname = '\0';
+			(*committed)++;
+			continue;
+		} else
+			rc = EXIT_FAILURE;
+
+		/* A key slot still has the new passphrase, never remove
+		 * the challenge it was made from. */
+		fprintf(stderr, "New challenge for Yubikey with serial %d is kept in %s, "
+				"some key slot needs it!\n", key->session.serial, key->challengefiletmpname);
+		*key->challengefiletmpname = '\0';
+	}
+
+	/* make the renames durable */
+	if (*committed > 0) {
+		if ((fd = open(YKFDE_CHALLENGEDIR, O_RDONLY | O_DIRECTORY)) < 0 || fsync(fd) < 0) {
+			fprintf(stderr, "Failed to sync challenge directory to disk.\n");
+			rc = EXIT_FAILURE;
+		}
+		if (fd >= 0)
+			close(fd);
+	}
+
+	return rc;
+}
+
+/*** run_cpio ***/
+static int run_cpio(void) {
+	char * const argv[] = { CPIOBIN, NULL };
+	extern char ** environ;
+	int status;
+	pid_t pid;
+
+	if ((errno = posix_spawn(&pid, CPIOBIN, NULL, NULL, argv, environ)) != 0) {
+		perror("Failed to run " CPIOBIN);
+		return EXIT_FAILURE;
+	}
+
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR) {
+			perror("waitpid() failed");
+			return EXIT_FAILURE;
+		}
+
+	if (WIFEXITED(status) == 0 || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		fprintf(stderr, CPIOBIN " failed.\n");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*** bench_backends ***/
+static int bench_backends(dictionary * ini) {
+	const char * names[] = BENCH_BACKENDS;
+	struct ykfde_session session;
+	char challenge[CHALLENGELEN + 1], passphrase[PASSPHRASELEN + 1];
+	uint64_t start, open, serial, response;
+	unsigned int i, j;
+	int rc = EXIT_SUCCESS;
+
+	/* the response is not used, any challenge will do */
+	memset(challenge, 'a', CHALLENGELEN);
+	challenge[CHALLENGELEN] = 0;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (iniparser_set(ini, "general:" CONFBACKEND, names[i]) != 0 ||
+				ykfde_init(ini) != EXIT_SUCCESS) {
+			fprintf(stderr, "Backend %s is not available.\n", names[i]);
+			rc = EXIT_FAILURE;
+			continue;
+		}
+
+		open = serial = response = 0;
+		for (j = 0; j < BENCH_RUNS; j++) {
+			start = now_usec();
+			if (ykfde_open(&session, 0) != EXIT_SUCCESS) {
+				fprintf(stderr, "No Yubikey found with backend %s.\n", names[i]);
+				break;
+			}
+			open += now_usec() - start;
+
+			start = now_usec();
+			if (ykfde_identify(&session) != EXIT_SUCCESS) {
+				ykfde_close(&session);
+				break;
+			}
+			serial += now_usec() - start;
+
+			start = now_usec();
+			if (ykfde_challenge_response(&session, challenge, passphrase) != EXIT_SUCCESS) {
+				ykfde_close(&session);
+				break;
+			}
+			response += now_usec() - start;
+
+			ykfde_close(&session);
+		}
+
+		ykfde_release();
+
+		if (j < BENCH_RUNS) {
+			rc = EXIT_FAILURE;
+			continue;
+		}
+
+		if (json == true)
+			printf("{ \"backend\": \"%s\", \"runs\": %d, \"open_usec\": %" PRIu64 ", "
+					"\"serial_usec\": %" PRIu64 ", \"response_usec\": %" PRIu64 " }\n",
+					names[i], BENCH_RUNS, open / BENCH_RUNS,
+					serial / BENCH_RUNS, response / BENCH_RUNS);
+		else
+			printf("%-8s open %" PRIu64 " us, serial %" PRIu64 " us, challenge-response %" PRIu64 " us"
+					" (average of %d runs)\n", names[i], open / BENCH_RUNS,
+					serial / BENCH_RUNS, response / BENCH_RUNS, BENCH_RUNS);
+	}
+
+	memset(passphrase, 0, PASSPHRASELEN + 1);
+
+	return rc;
+}
+
+/*** main ***/
 int main(int argc, char **argv) {
-	unsigned int version = 0, help = 0, challenge_int[CHALLENGELEN];
-	char challenge_old[CHALLENGELEN + 1],
-		challenge_new[CHALLENGELEN + 1],
-		response_old[RESPONSELEN],
-		response_new[RESPONSELEN],
-		passphrase_old[PASSPHRASELEN + 1],
-		passphrase_new[PASSPHRASELEN + 1];
+	unsigned int version = 0, help = 0, all = 0, bench = 0, scheduled = 0, committed = 0,
+		interval = 0;
 	const char * tmp;
-	char challengefilename[sizeof(CHALLENGEDIR) + 11 /* "/challenge-" */ + 10 /* unsigned int in char */ + 1],
-		challengefiletmpname[sizeof(CHALLENGEDIR) + 11 /* "/challenge-" */ + 10 /* unsigned int in char */ + 7 /* -XXXXXX */ + 1];
-	int challengefile = 0, challengefiletmp = 0;
 	int i;
-	size_t len;
+	unsigned int j;
 	int8_t rc = EXIT_FAILURE;
+	bool inactive = false, reuse;
 	/* cryptsetup */
-	const char * device_name;
-	int8_t luks_slot = -1;
-	struct crypt_device *cryptdevice;
-	crypt_status_info cryptstatus;
-	crypt_keyslot_info cryptkeyslot;
 	char * passphrase = NULL;
 	/* keyutils */
-	key_serial_t key = -1;
+	key_serial_t key_2f = -1;
 	void * payload = NULL;
 	char * second_factor = NULL, * new_2nd_factor = NULL, * new_2nd_factor_verify = NULL;
-	/* yubikey */
-	YK_KEY * yk;
-	uint8_t yk_slot = SLOT_CHAL_HMAC2;
-	unsigned int serial = 0;
 	/* iniparser */
 	dictionary * ini;
-	char section_ykslot[10 /* unsigned int in char */ + 1 + sizeof(CONFYKSLOT) + 1];
-	char section_luksslot[10 + 1 + sizeof(CONFLUKSSLOT) + 1];
 
 	/* get command line options */
 	while ((i = getopt_long(argc, argv, optstring, options_long, NULL)) != -1)
 		switch (i) {
+			case 'a':
+				all++;
+				break;
+			case 'b':
+				bench++;
+				break;
 			case 'h':
 				help++;
 				break;
+			case 'j':
+				json = true;
+				break;
 			case 'n':
 			case 'N':
 				if (new_2nd_factor != NULL) {
@@ -189,6 +1139,9 @@ int main(int argc, char **argv) {
 					memset(optarg, '*', strlen(optarg));
 				}
 
+				break;
+			case 't':
+				scheduled++;
 				break;
 			case 'V':
 				version++;
@@ -199,75 +1152,46 @@ int main(int argc, char **argv) {
 		printf("%s: %s v%s (compiled: " __DATE__ ", " __TIME__ ")\n", argv[0], PROGNAME, VERSION);
 
 	if (help > 0)
-		fprintf(stderr, "usage: %s [-h|--help] [-n|--new-2nd-factor <new-2nd-factor>] [-N|--ask-new-2nd-factor]\n"
-				"        [-s|--2nd-factor <2nd-factor>] [-S|--ask-2nd-factor] [-V|--version]\n", argv[0]);
+		fprintf(stderr, "usage: %s [-a|--all] [-b|--bench] [-h|--help] [-j|--json]\n"
+				"        [-n|--new-2nd-factor <new-2nd-factor>] [-N|--ask-new-2nd-factor]\n"
+				"        [-s|--2nd-factor <2nd-factor>] [-S|--ask-2nd-factor]\n"
+				"        [-t|--scheduled] [-V|--version]\n", argv[0]);
 
 	if (version > 0 || help > 0)
 		return EXIT_SUCCESS;
 
-	/* initialize static buffers */
-	memset(challenge_int, 0, CHALLENGELEN * sizeof(unsigned int));
-	memset(challenge_old, 0, CHALLENGELEN + 1);
-	memset(challenge_new, 0, CHALLENGELEN + 1);
-	memset(response_old, 0, RESPONSELEN);
-	memset(response_new, 0, RESPONSELEN);
-	memset(passphrase_old, 0, PASSPHRASELEN + 1);
-	memset(passphrase_new, 0, PASSPHRASELEN + 1);
-
-	if ((ini = iniparser_load(CONFIGFILE)) == NULL) {
+	if ((ini = iniparser_load(YKFDE_CONFIGFILE)) == NULL) {
 		fprintf(stderr, "Could not parse configuration file.\n");
 		goto out10;
 	}
 
-	if ((device_name = iniparser_getstring(ini, "general:" CONFDEVNAME, NULL)) == NULL) {
-		/* read from crypttab? */
-		/* get device from currently open devices? */
-		fprintf(stderr, "Could not read LUKS device from configuration file.\n");
+	/* compare latency of backends, nothing is changed */
+	if (bench > 0) {
+		rc = bench_backends(ini);
 		goto out20;
 	}
 
-	/* init and open first Yubikey */
-	if (yk_init() == 0) {
-		perror("yk_init() failed");
+	/* init challenge-response backend */
+	if (ykfde_init(ini) != EXIT_SUCCESS)
 		goto out20;
-	}
 
-	if ((yk = yk_open_first_key()) == NULL) {
-		fprintf(stderr, "No Yubikey available.\n");
-		goto out30;
-	}
+	/* a scheduled run follows the rotation policy, a manual one does not */
+	if (scheduled > 0 && (i = iniparser_getint(ini, "general:" CONFROTATIONINTERVAL, 0)) > 0)
+		interval = i;
 
-	/* read the serial number from key */
-	if (yk_get_serial(yk, 0, 0, &serial) == 0) {
-		perror("yk_get_serial() failed");
-		goto out40;
-	}
+	/* open first Yubikey, or all enrolled ones in batch mode */
+	if (open_keys(ini, all > 0, interval) != EXIT_SUCCESS)
+		goto out30;
 
-	/* get the yk slot */
-	sprintf(section_ykslot, "%d:" CONFYKSLOT, serial);
-	yk_slot = iniparser_getint(ini, "general:" CONFYKSLOT, yk_slot);
-	yk_slot = iniparser_getint(ini, section_ykslot, yk_slot);
-	switch (yk_slot) {
-		case 1:
-		case SLOT_CHAL_HMAC1:
-			yk_slot = SLOT_CHAL_HMAC1;
-			break;
-		case 2:
-		case SLOT_CHAL_HMAC2:
-		default:
-			yk_slot = SLOT_CHAL_HMAC2;
-			break;
+	/* every key was rotated recently */
+	if (keys_count == 0) {
+		rc = EXIT_SUCCESS;
+		sd_notify(0, "READY=1\nSTATUS=Nothing to do.");
+		goto out30;
 	}
 
-	/* get the luks slot */
-	sprintf(section_luksslot, "%d:" CONFLUKSSLOT, serial);
-	luks_slot = iniparser_getint(ini, section_luksslot, luks_slot);
-	if (luks_slot < 0) {
-		fprintf(stderr, "Please set LUKS key slot for Yubikey with serial %d!\n"
-				"Add something like this to " CONFIGFILE ":\n\n"
-				"[%d]\nluks slot = 1\n", serial, serial);
-		goto out40;
-	}
+	/* the old response may be left in keyring by the worker */
+	reuse = iniparser_getboolean(ini, "general:" CONFREUSERESPONSE, 0) > 0;
 
 	/* try to get a second factor */
 	if (iniparser_getboolean(ini, "general:" CONF2NDFACTOR, 0) > 0 &&
@@ -275,16 +1199,25 @@ int main(int argc, char **argv) {
 		if (sd_notify(0, "READY=0\nSTATUS=Detecting systemd...") == 0)
 			fprintf(stderr, "Not running from systemd, you may have to give\n"
 					"second factor manually if required.\n");
-		else if ((key = keyctl_search(KEY_SPEC_USER_KEYRING, "user", "ykfde-2f", 0)) < 0)
+		else if ((key_2f = keyctl_search(ykfde_keyring(), "user", "ykfde-2f", 0)) < 0)
 			/* get second factor from key store */
 			fprintf(stderr, "Failed requesting key. That's ok if you do not use\n"
 					"second factor. Give it manually if required.\n");
 
+		/* The second factor from boot expires in keyring. Without it
+		 * a scheduled rotation can not succeed, say so loudly. */
+		if (key_2f < 0 && scheduled > 0) {
+			fprintf(stderr, "Second factor is not in keyring (any more), it expires some minutes\n"
+					"after boot. Skipping scheduled rotation, run ykfde manually.\n");
+			sd_notify(0, "READY=1\nSTATUS=Second factor expired, rotation skipped.");
+			goto out30;
+		}
+
 		/* if we have a key id we have a key - so this should succeed */
-		if (key > -1) {
-			if (keyctl_read_alloc(key, &payload) < 0) {
+		if (key_2f > -1) {
+			if (keyctl_read_alloc(key_2f, &payload) < 0) {
 				perror("Failed reading payload from key");
-				goto out40;
+				goto out30;
 			}
 			second_factor = payload;
 		}
@@ -300,171 +1233,72 @@ int main(int argc, char **argv) {
 			 (new_2nd_factor != NULL && *new_2nd_factor != 0)))
 		fprintf(stderr, "Warning: Processing second factor, but not enabled in config!\n");
 
-	/* get random number - try random first, fall back to urandom
-	   We generate an array of unsigned int, the use modulo to limit to printable
-	   ASCII characters (32 to 127). */
-	if ((len = getrandom(challenge_int, CHALLENGELEN * sizeof(unsigned int), GRND_RANDOM|GRND_NONBLOCK)) != CHALLENGELEN * sizeof(unsigned int))
-		len += getrandom((void *)((size_t)challenge_int + len), CHALLENGELEN * sizeof(unsigned int) - len, 0);
-	for (i = 0; i < CHALLENGELEN; i++)
-		challenge_new[i] = (challenge_int[i] % (127 - 32)) + 32;
+	/* check all devices before anything is changed */
+	for (j = 0; j < keys_count; j++)
+		if (check_devices(&keys[j], &inactive) != EXIT_SUCCESS)
+			goto out30;
 
-	/* these are the filenames for challenge
-	 * we need this for reading and writing */
-	sprintf(challengefilename, CHALLENGEDIR "/challenge-%d", serial);
-	sprintf(challengefiletmpname, CHALLENGEDIR "/challenge-%d-XXXXXX", serial);
-
-	/* write new challenge to file */
-	if ((challengefiletmp = mkstemp(challengefiletmpname)) < 0) {
-		fprintf(stderr, "Could not open file %s for writing.\n", challengefiletmpname);
-		goto out40;
-	}
-	if (write(challengefiletmp, challenge_new, CHALLENGELEN) < 0) {
-		fprintf(stderr, "Failed to write challenge to file.\n");
-		goto out50;
-	}
-	if (fsync(challengefiletmp) < 0) {
-		fprintf(stderr, "Failed to sync file to disk.\n");
-		goto out50;
-	}
-	challengefiletmp = close(challengefiletmp);
+	/* write new challenges to files, synced to disk once */
+	if (write_challenges() != EXIT_SUCCESS)
+		goto out30;
 
-	/* now that the new challenge has been written to file...
-	 * add second factor to new challenge */
 	tmp = new_2nd_factor ? new_2nd_factor : second_factor;
-	len = strlen(tmp);
-	memcpy(challenge_new, tmp, len < MAX2FLEN ? len : MAX2FLEN);
-
-	/* do challenge/response and encode to hex */
-	if (yk_challenge_response(yk, yk_slot, true,
-			CHALLENGELEN, (unsigned char *) challenge_new,
-			RESPONSELEN, (unsigned char *) response_new) == 0) {
-		perror("yk_challenge_response() failed");
-		goto out50;
-	}
-	yubikey_hex_encode((char *) passphrase_new, (char *) response_new, SHA1_DIGEST_SIZE);
-
-	/* get status of crypt device
-	 * We expect this to be active (or busy). It is the actual root device, no? */
-	cryptstatus = crypt_status(cryptdevice, device_name);
-	if (cryptstatus != CRYPT_ACTIVE && cryptstatus != CRYPT_BUSY) {
-		fprintf(stderr, "Device %s is invalid or inactive.\n", device_name);
-		goto out50;
-	}
-
-	/* initialize crypt device */
-	if (crypt_init_by_name(&cryptdevice, device_name) < 0) {
-		fprintf(stderr, "Device %s failed to initialize.\n", device_name);
-		goto out60;
-	}
-
-	cryptkeyslot = crypt_keyslot_status(cryptdevice, luks_slot);
-
-	if (cryptkeyslot == CRYPT_SLOT_INVALID) {
-		fprintf(stderr, "Key slot %d is invalid.\n", luks_slot);
-		goto out60;
-	} else if (cryptkeyslot == CRYPT_SLOT_ACTIVE || cryptkeyslot == CRYPT_SLOT_ACTIVE_LAST) {
-		/* read challenge from file */
-		if ((challengefile = open(challengefilename, O_RDONLY)) < 0) {
-			perror("Failed opening challenge file for reading");
-			goto out60;
-		}
-
-		if (read(challengefile, challenge_old, CHALLENGELEN) < 0) {
-			perror("Failed reading challenge from file");
-			goto out60;
-		}
-
-		challengefile = close(challengefile);
-		/* finished reading challenge */
-
-		/* copy the second factor */
-		len = strlen(second_factor);
-		memcpy(challenge_old, second_factor, len < MAX2FLEN ? len : MAX2FLEN);
-
-		/* do challenge/response and encode to hex */
-		if (yk_challenge_response(yk, yk_slot, true,
-				CHALLENGELEN, (unsigned char *) challenge_old,
-				RESPONSELEN, (unsigned char *) response_old) == 0) {
-			perror("yk_challenge_response() failed");
-			goto out60;
-		}
-		yubikey_hex_encode((char *) passphrase_old, (char *) response_old, SHA1_DIGEST_SIZE);
-
-		if (crypt_keyslot_change_by_passphrase(cryptdevice, luks_slot, luks_slot,
-				passphrase_old, PASSPHRASELEN,
-				passphrase_new, PASSPHRASELEN) < 0) {
-			fprintf(stderr, "Could not update passphrase for key slot %d.\n", luks_slot);
-			goto out60;
-		}
-
-		if (renameat2(AT_FDCWD, challengefiletmpname, AT_FDCWD, challengefilename, RENAME_EXCHANGE) < 0) {
-			fprintf(stderr, "Failed to rename (exchange) challenge files.\n");
-			goto out60;
-		}
-
-		if (unlink(challengefiletmpname) < 0) {
-			fprintf(stderr, "Failed to delete old challenge file.\n");
-			goto out60;
-		}
-	} else { /* ck == CRYPT_SLOT_INACTIVE */
-		if ((passphrase = ask_secret("existing LUKS passphrase")) == NULL)
-			goto out60;
-
-		if (crypt_keyslot_add_by_passphrase(cryptdevice, luks_slot,
-				passphrase, strlen(passphrase),
-				passphrase_new, PASSPHRASELEN) < 0) {
-			fprintf(stderr, "Could not add passphrase for key slot %d.\n", luks_slot);
-			goto out60;
-		}
-
-		if (rename(challengefiletmpname, challengefilename) < 0) {
-			fprintf(stderr, "Failed to rename new challenge file.\n");
-			goto out60;
+	for (j = 0; j < keys_count; j++) {
+		/* now that the new challenge has been written to file...
+		 * add second factor to new challenge and get passphrase */
+		if (get_passphrase(&keys[j], keys[j].challenge_new, tmp, keys[j].passphrase_new) != EXIT_SUCCESS)
+			goto out30;
+
+		/* the old passphrase is shared by all devices of a key */
+		if (keys[j].active == true) {
+			if (ykfde_read_challenge(keys[j].session.serial, keys[j].challenge_old) != EXIT_SUCCESS) {
+				fprintf(stderr, "Failed reading challenge for Yubikey with serial %d.\n",
+						keys[j].session.serial);
+				goto out30;
+			}
+			/* the worker may have left the response from boot,
+			 * that saves a round trip (and touch) */
+			ykfde_second_factor(keys[j].challenge_old, second_factor, strlen(second_factor));
+			if (reuse == true && ykfde_load_response(&keys[j].session,
+					keys[j].challenge_old, keys[j].passphrase_old) == EXIT_SUCCESS)
+				continue;
+			if (ykfde_challenge_response(&keys[j].session, keys[j].challenge_old,
+					keys[j].passphrase_old) != EXIT_SUCCESS)
+				goto out30;
 		}
 	}
 
-	sd_notify(0, "READY=1\nSTATUS=All done.");
+	/* ask once for all slots to add */
+	if (inactive == true)
+		if ((passphrase = ask_secret("existing LUKS passphrase")) == NULL)
+			goto out30;
 
-	rc = EXIT_SUCCESS;
+	update_keyslots(passphrase);
 
-out60:
-	/* free crypt context */
-	crypt_free(cryptdevice);
+	rc = commit_challenges(&committed);
 
-out50:
-	/* close the challenge file */
-	if (challengefile)
-		close(challengefile);
-	if (challengefiletmp)
-		close(challengefiletmp);
-	if (access(challengefiletmpname, F_OK) == 0)
-		unlink(challengefiletmpname);
+	/* update the cpio archive once for the whole batch */
+	if (all > 0 && committed > 0 && run_cpio() != EXIT_SUCCESS)
+		rc = EXIT_FAILURE;
 
-out40:
-	/* close Yubikey */
-	if (yk_close_key(yk) == 0)
-		perror("yk_close_key() failed");
+	if (rc == EXIT_SUCCESS)
+		sd_notify(0, "READY=1\nSTATUS=All done.");
 
 out30:
-	/* release Yubikey */
-	if (yk_release() == 0)
-		perror("yk_release() failed");
+	/* close Yubikeys, remove stale challenge files */
+	close_keys();
+
+	/* release backend */
+	ykfde_release();
 
 out20:
 	/* free iniparser dictionary */
 	iniparser_freedict(ini);
 
 out10:
-	/* wipe response (cleartext password!) from memory */
-	/* This is statically allocated and always save to wipe! */
-	memset(challenge_int, 0, CHALLENGELEN * sizeof(unsigned int));
-	memset(challenge_old, 0, CHALLENGELEN + 1);
-	memset(challenge_new, 0, CHALLENGELEN + 1);
-	memset(response_old, 0, RESPONSELEN);
-	memset(response_new, 0, RESPONSELEN);
-	memset(passphrase_old, 0, PASSPHRASELEN + 1);
-	memset(passphrase_new, 0, PASSPHRASELEN + 1);
-
+	/* wipe passphrases (cleartext password!) from memory */
+	if (passphrase != NULL)
+		memset(passphrase, 0, strlen(passphrase));
 	free(passphrase);
 	free(new_2nd_factor_verify);
 	free(new_2nd_factor);
@@ -19,6 +19,12 @@
 #ifndef _CONFIG_H
 #define _CONFIG_H
 
+/* Paths to configuration file, challenges, cpio archive and binary
+ * index can be overridden at runtime with environment variables
+ * YKFDE_CONFIGFILE, YKFDE_CHALLENGEDIR, YKFDE_CPIOFILE and
+ * YKFDE_INDEXFILE, the worker's ask-password directory with
+ * YKFDE_ASK_PATH. */
+
 /* path to the configuration file */
 #define	CONFIGFILE	"/etc/ykfde.conf"
 
@@ -34,10 +40,57 @@
 #define CONFLUKSSLOT	"luks slot"
 /* config file second factor */
 #define CONF2NDFACTOR	"second factor"
+/* config file challenge-response backend */
+#define CONFBACKEND	"backend"
+/* config file secret file for soft backend */
+#define CONFSOFTSECRET	"soft secret"
+/* config file pbkdf for keyslots */
+#define CONFPBKDF	"pbkdf"
+/* config file pbkdf iterations (time cost) */
+#define CONFPBKDFITER	"pbkdf iterations"
+/* config file pbkdf memory cost in kilobytes */
+#define CONFPBKDFMEMORY	"pbkdf memory"
+/* config file pbkdf parallel threads */
+#define CONFPBKDFPARALLEL	"pbkdf parallel"
+/* config file LUKS2 token for the token plugin */
+#define CONFLUKSTOKEN	"luks token"
+/* config file direct activation from worker */
+#define CONFACTIVATE	"activate"
+/* config file reuse of response from boot for rotation */
+#define CONFREUSERESPONSE	"reuse response"
+/* config file passphrases derived per device */
+#define CONFDERIVE	"derive passphrase"
+/* config file deadline for retries of busy Yubikeys in worker */
+#define CONFRETRYDEADLINE	"retry deadline"
+/* config file hours between scheduled rotations */
+#define CONFROTATIONINTERVAL	"rotation interval"
+/* config file compression of cpio archive */
+#define CONFCOMPRESSION	"cpio compression"
+/* config file compression level of cpio archive */
+#define CONFCOMPRESSIONLEVEL	"cpio compression level"
+
+/* keyring description and timeout in seconds for the response the
+ * worker leaves for ykfde, it has to be picked up by ykfde.service */
+#define RESPONSEKEY	"ykfde-response:%u"
+#define RESPONSETIMEOUT	300
+
+/* default for how long the worker retries a Yubikey that is busy or
+ * not yet responsive, in milliseconds */
+#define RETRYDEADLINE	3000
+
+/* path to crypttab in initramfs */
+#define CRYPTTAB	"/etc/crypttab"
 
 /* path to cpio archive (initramfs image) */
 #define CPIOFILE	"/boot/ykfde-challenges.img"
-/* path to temporary cpio archive (initramfs image) */
-#define CPIOTMPFILE	CPIOFILE "-XXXXXX"
+/* suffix of temporary cpio archive and manifest */
+#define CPIOTMPSUFFIX	"-XXXXXX"
+/* suffix of manifest of cpio archive, regeneration is skipped
+ * if the challenges did not change */
+#define CPIOMANIFESTSUFFIX	".sha1"
+/* path to binary index in cpio archive, with config and challenges */
+#define INDEXFILE	"/etc/ykfde.idx"
+/* path to ykfde-cpio, run once after batch update */
+#define CPIOBIN		"/usr/bin/ykfde-cpio"
 
 #endif /* _CONFIG_H */
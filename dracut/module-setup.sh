@@ -15,9 +15,18 @@ install() {
 	inst_hook cmdline 30 "$moddir/parse-mod.sh"
 	inst_simple "$moddir/ykfde.sh" /sbin/ykfde.sh
 	inst_binary /usr/lib/ykfde/worker
+	inst_library /usr/lib/cryptsetup/libcryptsetup-token-ykfde.so
 	inst_simple /etc/ykfde.conf
 	inst_simple /usr/lib/systemd/system/ykfde-worker.service
 	ln_r $systemdsystemunitdir/ykfde-worker.service $systemdsystemunitdir/sysinit.target.wants/ykfde-worker.service
+	inst_simple /usr/lib/systemd/system/ykfde-worker-stop.service
+	ln_r $systemdsystemunitdir/ykfde-worker-stop.service $systemdsystemunitdir/cryptsetup.target.wants/ykfde-worker-stop.service
+
+	# compile config and challenges into the index in cpio archive,
+	# the worker falls back to config file if this fails
+	if ! /usr/bin/ykfde-cpio; then
+		dwarn "Failed compiling ykfde index, run 'ykfde-cpio' manually."
+	fi
 
 	# this is required for second factor
 	if grep -E -qi 'second factor = (yes|true|1)' /etc/ykfde.conf; then
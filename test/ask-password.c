@@ -0,0 +1,135 @@
+/*
+ * (C) 2014-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Plays systemd-cryptsetup for the boot simulation: places a password
+ * request in the ask directory, with a listening datagram socket,
+ * and waits for the answer. Prints a line of JSON with what it got
+ * and the time it took, since the request and since a given start. */
+
+/*** clock_usec ***/
+static uint64_t clock_usec(clockid_t clock) {
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*** main ***/
+int main(int argc, char ** argv) {
+	int rc = EXIT_FAILURE, fd;
+	struct sockaddr_un sa = { .sun_family = AF_UNIX };
+	char askfile[PATH_MAX], asktmpfile[PATH_MAX], answer[256];
+	struct pollfd pfd;
+	uint64_t since, start, timeout;
+	FILE * ask;
+	ssize_t len = -1;
+
+	if (argc != 5) {
+		fprintf(stderr, "usage: %s <ask directory> <id> <timeout ms> <start epoch usec>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	timeout = strtoull(argv[3], NULL, 10);
+	since = strtoull(argv[4], NULL, 10);
+
+	if (snprintf(sa.sun_path, sizeof(sa.sun_path), "%s/sck.%d", argv[1], getpid()) >= sizeof(sa.sun_path) ||
+			snprintf(askfile, sizeof(askfile), "%s/ask.%d", argv[1], getpid()) >= sizeof(askfile) ||
+			snprintf(asktmpfile, sizeof(asktmpfile), "%s/.ask.%d", argv[1], getpid()) >= sizeof(asktmpfile)) {
+		fprintf(stderr, "Path %s is too long.\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+		perror("socket() failed");
+		return EXIT_FAILURE;
+	}
+
+	unlink(sa.sun_path);
+	if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+		perror("bind() failed");
+		goto out10;
+	}
+
+	/* written in one go, then renamed in place - as systemd does */
+	if ((ask = fopen(asktmpfile, "w")) == NULL) {
+		perror("Failed opening ask file");
+		goto out20;
+	}
+	fprintf(ask, "[Ask]\nPID=%d\nSocket=%s\nAcceptCached=1\nEcho=0\n"
+			"NotAfter=%" PRIu64 "\nId=%s\nMessage=Boot simulation\n",
+			getpid(), sa.sun_path, clock_usec(CLOCK_MONOTONIC) + timeout * 1000, argv[2]);
+	if (fclose(ask) != 0) {
+		perror("Failed writing ask file");
+		goto out30;
+	}
+
+	start = clock_usec(CLOCK_MONOTONIC);
+	if (rename(asktmpfile, askfile) < 0) {
+		perror("rename() failed");
+		goto out30;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while ((rc = poll(&pfd, 1, timeout)) < 0 && errno == EINTR);
+	if (rc > 0)
+		len = recv(fd, answer, sizeof(answer) - 1, 0);
+
+	/* the answer is '+' and passphrase, '-' for cancel */
+	if (len > 1 && *answer == '+') {
+		answer[len] = 0;
+		printf("{ \"answered\": true, \"answer\": \"%s\", \"ask_usec\": %" PRIu64
+				", \"boot_usec\": %" PRIu64 " }\n", answer + 1,
+				clock_usec(CLOCK_MONOTONIC) - start, clock_usec(CLOCK_REALTIME) - since);
+		rc = EXIT_SUCCESS;
+	} else {
+		printf("{ \"answered\": false }\n");
+		rc = EXIT_FAILURE;
+	}
+
+	memset(answer, 0, sizeof(answer));
+
+	unlink(askfile);
+
+out30:
+	unlink(asktmpfile);
+
+out20:
+	unlink(sa.sun_path);
+
+out10:
+	close(fd);
+
+	return rc;
+}
@@ -0,0 +1,167 @@
+#!/bin/bash
+
+# (C) 2014-2026 by Christian Hesse <mail@eworm.de>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+
+# Benchmarks for 'make bench', printed as one JSON document to track
+# numbers between releases. Everything runs on files of its own with
+# the soft backend, no Yubikey is required:
+#
+# - backends: latency of challenge-response, from 'ykfde --bench'
+# - cpio: size and time per codec for 1, 100 and 10000 challenges
+# - worker: boot simulation end to end, see boot-sim.sh
+# - rotation: 'ykfde' enrolling and rotating a key slot on a LUKS2
+#   loop device, this needs root and is skipped otherwise
+
+set -u
+
+BOOTS=200
+ROTATIONS=10
+SERIAL=1234567
+
+TEST=$(cd "$(dirname "${0}")" && pwd)
+BIN=${BIN:-${TEST}/../bin}
+
+. "${TEST}/functions.sh"
+
+usage() {
+	echo "usage: ${0} [-n boots] [-r rotations]" >&2
+	exit 1
+}
+
+while getopts "n:r:h" opt; do
+	case ${opt} in
+		n) BOOTS=${OPTARG} ;;
+		r) ROTATIONS=${OPTARG} ;;
+		*) usage ;;
+	esac
+done
+
+for bin in ykfde ykfde-cpio worker; do
+	if [ ! -x "${BIN}/${bin}" ]; then
+		echo "${BIN}/${bin} is missing, run 'make' first." >&2
+		exit 1
+	fi
+done
+
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/ykfde-bench-XXXXXX")
+MAPPING=
+LOOP=
+cleanup() {
+	[ -n "${MAPPING}" ] && cryptsetup close "${MAPPING}"
+	[ -n "${LOOP}" ] && losetup --detach "${LOOP}"
+	rm -rf "${DIR}"
+}
+trap cleanup EXIT
+
+mkdir "${DIR}/challenges"
+echo "${SERIAL} $(od -An -N20 -tx1 /dev/urandom | tr -d ' \n')" > "${DIR}/soft.secret"
+cat > "${DIR}/ykfde.conf" <<EOF
+[general]
+backend = soft
+soft secret = ${DIR}/soft.secret
+EOF
+
+export YKFDE_CONFIGFILE=${DIR}/ykfde.conf
+export YKFDE_CHALLENGEDIR=${DIR}/challenges
+export YKFDE_CPIOFILE=${DIR}/ykfde-challenges.img
+export YKFDE_INDEXFILE=${DIR}/ykfde.idx
+unset NOTIFY_SOCKET
+
+# challenges with random content, one awk for all of them
+challenges() {
+	rm -rf "${DIR}/sweep"
+	mkdir "${DIR}/sweep"
+	awk -v count="${1}" -v dir="${DIR}/sweep" 'BEGIN {
+		srand()
+		for (i = 1; i <= count; i++) {
+			file = dir "/challenge-" i
+			for (j = 0; j < 64; j++)
+				printf "%c", 97 + int(rand() * 26) > file
+			close(file)
+		}
+	}'
+}
+
+bench_backends() {
+	"${BIN}/ykfde" --bench --json | grep '^{' | awk 'NR > 1 { printf ", " } { printf "%s", $0 }'
+}
+
+bench_cpio() {
+	local count out sep=
+
+	for count in 1 100 10000; do
+		challenges "${count}"
+		out=$(YKFDE_CHALLENGEDIR=${DIR}/sweep "${BIN}/ykfde-cpio" --bench --json | sed '2,$s/^/\t/')
+		printf '%s%s' "${sep}" "${out}"
+		sep=', '
+	done
+	rm -rf "${DIR}/sweep"
+}
+
+bench_worker() {
+	local out
+
+	if ! command -v keyctl > /dev/null; then
+		printf '{ "skipped": "needs keyctl" }'
+		return
+	fi
+
+	# with failed boots there is output anyway, it tells
+	out=$(WORKER=${BIN}/worker ASKPASSWORD=${TEST}/ask-password \
+		"${TEST}/boot-sim.sh" -n "${BOOTS}" | sed '2,$s/^/\t/')
+	printf '%s' "${out:-{ \"failed\": \"boot simulation did not run\" \}}"
+}
+
+bench_rotation() {
+	local i enroll
+
+	if [ "$(id -u)" -ne 0 ] || ! command -v cryptsetup > /dev/null || ! command -v losetup > /dev/null; then
+		printf '{ "skipped": "needs root, losetup and cryptsetup" }'
+		return
+	fi
+
+	# a small device, cheapest pbkdf for both human and ykfde slot
+	truncate -s 32M "${DIR}/disk.img"
+	if ! LOOP=$(losetup --find --show "${DIR}/disk.img") ||
+			! printf 'bench' | cryptsetup luksFormat --batch-mode --type luks2 --pbkdf pbkdf2 \
+				--pbkdf-force-iterations 1000 --key-file - "${LOOP}" ||
+			! printf 'bench' | cryptsetup open --key-file - "${LOOP}" "ykfde-bench-${$}"; then
+		printf '{ "failed": "could not set up LUKS2 loop device" }'
+		return
+	fi
+	MAPPING=ykfde-bench-${$}
+
+	cat >> "${DIR}/ykfde.conf" <<EOF
+device name = ${MAPPING}
+pbkdf = pbkdf2
+pbkdf iterations = 1000
+
+[${SERIAL}]
+luks slot = 1
+EOF
+
+	# the first run adds the slot, with the human passphrase
+	enroll=$(echo bench | "${BIN}/ykfde" --json | grep '"luks_slot"')
+	for ((i = 0; i < ROTATIONS; i++)); do
+		"${BIN}/ykfde" --json < /dev/null | grep '"luks_slot"'
+	done > "${DIR}/rotations"
+
+	printf '{ "device": "luks2", "enroll": %s, "rotations": %d, "update_usec": %s, "cpu_usec": %s }' \
+		"${enroll:-null}" "$(wc -l < "${DIR}/rotations")" \
+		"$(field update_usec < "${DIR}/rotations" | percentiles)" \
+		"$(field cpu_usec < "${DIR}/rotations" | percentiles)"
+}
+
+cat <<EOF
+{
+	"backends": [ $(bench_backends) ],
+	"cpio": [ $(bench_cpio) ],
+	"worker": $(bench_worker),
+	"rotation": $(bench_rotation)
+}
+EOF
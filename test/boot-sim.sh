@@ -0,0 +1,189 @@
+#!/bin/bash
+
+# (C) 2014-2026 by Christian Hesse <mail@eworm.de>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+
+# Boot simulation for the worker. Every boot starts the worker in
+# resident mode and a password request (as systemd-cryptsetup would),
+# in random order and with random delay, in a private session keyring
+# and on files of its own. The soft backend stands in for the Yubikey,
+# nothing on the system is touched and no root is required. Prints
+# JSON with failures and the latency distribution.
+#
+# Needs 'keyctl' from keyutils, 'openssl' to verify the answers.
+
+set -u
+
+BOOTS=1000
+JITTER=50
+SECOND_FACTOR=0
+TIMEOUT=5000
+SERIAL=1234567
+
+TEST=$(cd "$(dirname "${0}")" && pwd)
+WORKER=${WORKER:-${TEST}/../bin/worker}
+ASKPASSWORD=${ASKPASSWORD:-${TEST}/ask-password}
+
+. "${TEST}/functions.sh"
+
+usage() {
+	echo "usage: ${0} [-n boots] [-j jitter ms] [-t timeout ms] [-2]" >&2
+	exit 1
+}
+
+# One boot, run in a session keyring of its own. The delay is the
+# time the request shows up after the worker was started, negative
+# if it was there before.
+boot() {
+	local delay=${1} delay_2f=${2} start ask worker rc
+
+	rm -f "${DIR}"/ask/* "${DIR}"/timings/*
+	start=$(date +%s%6N)
+
+	if [ "${delay}" -lt 0 ]; then
+		"${ASKPASSWORD}" "${DIR}/ask" "cryptsetup:${DIR}/disk" "${TIMEOUT}" "${start}" > "${DIR}/result" &
+		ask=${!}
+		sleep "$(msec "${delay#-}")"
+		"${WORKER}" --resident 2>> "${DIR}/worker.log" &
+		worker=${!}
+	else
+		"${WORKER}" --resident 2>> "${DIR}/worker.log" &
+		worker=${!}
+		sleep "$(msec "${delay}")"
+		"${ASKPASSWORD}" "${DIR}/ask" "cryptsetup:${DIR}/disk" "${TIMEOUT}" "${start}" > "${DIR}/result" &
+		ask=${!}
+	fi
+
+	# the user types the second factor
+	if [ "${delay_2f}" -ge 0 ]; then
+		sleep "$(msec "${delay_2f}")"
+		keyctl add user ykfde-2f "${SECOND}" @s > /dev/null
+	fi
+
+	wait "${ask}"
+	rc=${?}
+	kill -TERM "${worker}" 2> /dev/null
+	wait "${worker}"
+
+	# the result and what the worker measured
+	sed "s/ }\$/, \"delay_ms\": ${delay}, \"worker_total_usec\": $(field total_usec \
+		< "${DIR}"/timings/timings.json 2> /dev/null || echo 0) }/" "${DIR}/result"
+
+	return ${rc}
+}
+
+msec() {
+	printf '%d.%03d' $((${1} / 1000)) $((${1} % 1000))
+}
+
+if [ "${1:-}" = "--boot" ]; then
+	shift
+	boot "${@}"
+	exit ${?}
+fi
+
+while getopts "n:j:t:2h" opt; do
+	case ${opt} in
+		n) BOOTS=${OPTARG} ;;
+		j) JITTER=${OPTARG} ;;
+		t) TIMEOUT=${OPTARG} ;;
+		2) SECOND_FACTOR=1 ;;
+		*) usage ;;
+	esac
+done
+
+for bin in "${WORKER}" "${ASKPASSWORD}"; do
+	if [ ! -x "${bin}" ]; then
+		echo "${bin} is missing, run 'make' first." >&2
+		exit 1
+	fi
+done
+if ! command -v keyctl > /dev/null; then
+	echo "keyctl is missing, install keyutils." >&2
+	exit 1
+fi
+
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/ykfde-boot-sim-XXXXXX")
+trap 'rm -rf "${DIR}"' EXIT
+mkdir "${DIR}/ask" "${DIR}/challenges" "${DIR}/timings"
+
+# a soft key with its challenge, a device it unlocks
+SECRET=$(od -An -N20 -tx1 /dev/urandom | tr -d ' \n')
+CHALLENGE=$(od -An -N32 -tx1 /dev/urandom | tr -d ' \n')
+SECOND=$(od -An -N4 -tx1 /dev/urandom | tr -d ' \n')
+echo "${SERIAL} ${SECRET}" > "${DIR}/soft.secret"
+printf '%s' "${CHALLENGE}" > "${DIR}/challenges/challenge-${SERIAL}"
+echo "root ${DIR}/disk none luks" > "${DIR}/crypttab"
+cat > "${DIR}/ykfde.conf" <<EOF
+[general]
+device name = root
+backend = soft
+soft secret = ${DIR}/soft.secret
+second factor = $([ ${SECOND_FACTOR} -gt 0 ] && echo yes || echo no)
+EOF
+
+# the second factor replaces the start of the challenge
+if [ ${SECOND_FACTOR} -gt 0 ]; then
+	CHALLENGE=${SECOND}${CHALLENGE:${#SECOND}}
+fi
+EXPECT=
+if command -v openssl > /dev/null; then
+	EXPECT=$(printf '%s' "${CHALLENGE}" | openssl dgst -sha1 -mac HMAC -macopt "hexkey:${SECRET}" | sed 's/.*= //')
+fi
+
+export YKFDE_CONFIGFILE=${DIR}/ykfde.conf
+export YKFDE_CHALLENGEDIR=${DIR}/challenges
+export YKFDE_INDEXFILE=${DIR}/ykfde.idx
+export YKFDE_ASK_PATH=${DIR}/ask
+export YKFDE_TIMINGS_PATH=${DIR}/timings
+export YKFDE_CRYPTTAB=${DIR}/crypttab
+export YKFDE_KEYRING=session
+export DIR TIMEOUT SECOND WORKER ASKPASSWORD
+unset NOTIFY_SOCKET
+
+failed=0
+wrong=0
+for ((i = 0; i < BOOTS; i++)); do
+	delay=$((RANDOM % (2 * JITTER + 1) - JITTER))
+	delay_2f=-1
+	if [ ${SECOND_FACTOR} -gt 0 ]; then
+		delay_2f=$((RANDOM % (JITTER + 1)))
+	fi
+
+	if ! keyctl session - "${BASH}" "${0}" --boot "${delay}" "${delay_2f}" > "${DIR}/boot"; then
+		failed=$((failed + 1))
+		continue
+	fi
+
+	answer=$(sed -n 's/.*"answer": "\([0-9a-f]*\)".*/\1/p' "${DIR}/boot")
+	: "${EXPECT:=${answer}}"
+	if [ "${answer}" != "${EXPECT}" ]; then
+		wrong=$((wrong + 1))
+		continue
+	fi
+
+	sed 's/"answer": "[0-9a-f]*", //' "${DIR}/boot" >> "${DIR}/boots"
+done
+touch "${DIR}/boots"
+
+cat <<EOF
+{
+	"boots": ${BOOTS},
+	"jitter_ms": ${JITTER},
+	"second_factor": $([ ${SECOND_FACTOR} -gt 0 ] && echo true || echo false),
+	"failed": ${failed},
+	"wrong": ${wrong},
+	"ask_usec": $(field ask_usec < "${DIR}/boots" | percentiles),
+	"boot_usec": $(field boot_usec < "${DIR}/boots" | percentiles),
+	"worker_total_usec": $(field worker_total_usec < "${DIR}/boots" | percentiles)
+}
+EOF
+
+if [ ${failed} -gt 0 ] || [ ${wrong} -gt 0 ]; then
+	tail -n 20 "${DIR}/worker.log" >&2
+	exit 1
+fi
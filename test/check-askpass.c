@@ -0,0 +1,153 @@
+/*
+ * (C) 2014-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#define main worker_main
+#include "../bin/worker.c"
+#undef main
+
+#include "../bin/sha1.c"
+#include "../bin/backend.c"
+#include "../bin/libykfde.c"
+
+#include "check.h"
+
+/* ask file in a temporary directory we change to */
+#define ASK_FILE	"ask.check"
+
+struct unescape_vector {
+	const char * escaped;
+	const char * unescaped;
+};
+
+static const struct unescape_vector unescape_vectors[] = {
+	{ "cryptsetup:/dev/sda2", "cryptsetup:/dev/sda2" },
+	/* systemd escapes dashes in device paths */
+	{ "cryptsetup:/dev/disk/by-uuid/0b9f6a1c\\x2d3d2e", "cryptsetup:/dev/disk/by-uuid/0b9f6a1c-3d2e" },
+	{ "back\\\\slash", "back\\slash" },
+	{ "\\x41\\x42C", "ABC" },
+	/* invalid or truncated escapes are taken as is */
+	{ "\\xzz", "xzz" },
+	{ "trailing\\", "trailing\\" },
+	{ "short\\x4", "shortx4" },
+	{ "", "" },
+	{ NULL, NULL }
+};
+
+/*** write_ask ***/
+static int write_ask(const char * content) {
+	FILE * file;
+
+	if ((file = fopen(ASK_FILE, "w")) == NULL)
+		return EXIT_FAILURE;
+	fputs(content, file);
+
+	return fclose(file) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*** check_unescape ***/
+static void check_unescape(void) {
+	const struct unescape_vector * vector;
+	char buffer[64];
+
+	for (vector = unescape_vectors; vector->escaped != NULL; vector++) {
+		memset(buffer, 0xff, sizeof(buffer));
+		unescape(buffer, vector->escaped, sizeof(buffer));
+		CHECK_STR(buffer, vector->unescaped);
+	}
+
+	/* never more than size, including terminating null */
+	memset(buffer, 0xff, sizeof(buffer));
+	unescape(buffer, "0123456789", 5);
+	CHECK_STR(buffer, "0123");
+	CHECK((unsigned char) buffer[5] == 0xff);
+}
+
+/*** check_parse_askpass ***/
+static void check_parse_askpass(void) {
+	struct ask ask;
+	char content[ASK_FILE_MAX + 256];
+
+	/* what systemd-cryptsetup writes */
+	CHECK(write_ask("[Ask]\n"
+				"PID=123\n"
+				"Socket=/run/systemd/ask-password/sck.1234\n"
+				"AcceptCached=1\n"
+				"Echo=0\n"
+				"NotAfter=1700000000000000\n"
+				"Id=cryptsetup:/dev/disk/by-uuid/0b9f6a1c\\x2d3d2e\n"
+				"Message=Please enter passphrase for disk root\n") == EXIT_SUCCESS);
+	CHECK(parse_askpass(ASK_FILE, &ask) == EXIT_SUCCESS);
+	CHECK_STR(ask.socket, "/run/systemd/ask-password/sck.1234");
+	CHECK_STR(ask.id, "cryptsetup:/dev/disk/by-uuid/0b9f6a1c-3d2e");
+	CHECK(ask.not_after == 1700000000000000ull);
+
+	/* keys in other sections do not count, order does not matter */
+	CHECK(write_ask("[Other]\n"
+				"Socket=/wrong\n"
+				"Id=wrong\n"
+				"[Ask]\n"
+				"Id=cryptsetup:/dev/sda2\n"
+				"Socket=/run/sck\n") == EXIT_SUCCESS);
+	CHECK(parse_askpass(ASK_FILE, &ask) == EXIT_SUCCESS);
+	CHECK_STR(ask.socket, "/run/sck");
+	CHECK_STR(ask.id, "cryptsetup:/dev/sda2");
+	CHECK(ask.not_after == 0);
+
+	/* a request without socket can not be answered */
+	CHECK(write_ask("[Ask]\nId=cryptsetup:/dev/sda2\n") == EXIT_SUCCESS);
+	CHECK(parse_askpass(ASK_FILE, &ask) == EXIT_FAILURE);
+
+	/* a socket path that does not fit into sockaddr_un */
+	snprintf(content, sizeof(content), "[Ask]\nSocket=/%0*d\n", (int) sizeof(ask.socket), 0);
+	CHECK(write_ask(content) == EXIT_SUCCESS);
+	CHECK(parse_askpass(ASK_FILE, &ask) == EXIT_FAILURE);
+
+	/* the file may be gone already */
+	CHECK(unlink(ASK_FILE) == 0);
+	CHECK(parse_askpass(ASK_FILE, &ask) == EXIT_FAILURE);
+
+	/* no more than we read is parsed, no matter the size */
+	memset(content, 'x', sizeof(content) - 1);
+	content[sizeof(content) - 1] = 0;
+	memcpy(content, "[Ask]\nSocket=/run/sck\nId=", 25);
+	CHECK(write_ask(content) == EXIT_SUCCESS);
+	CHECK(parse_askpass(ASK_FILE, &ask) == EXIT_SUCCESS);
+	CHECK(strlen(ask.id) < sizeof(ask.id));
+	unlink(ASK_FILE);
+}
+
+/*** main ***/
+int main(int argc, char ** argv) {
+	char dir[] = "/tmp/check-askpass-XXXXXX";
+
+	check_unescape();
+
+	if (mkdtemp(dir) == NULL || chdir(dir) < 0) {
+		perror("Failed creating temporary directory");
+		return EXIT_FAILURE;
+	}
+
+	check_parse_askpass();
+
+	if (chdir("/") == 0)
+		rmdir(dir);
+
+	return CHECK_EXIT();
+}
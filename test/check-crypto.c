@@ -0,0 +1,190 @@
+/*
+ * (C) 2014-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "../bin/sha1.c"
+#include "../bin/backend.c"
+#include "../bin/libykfde.c"
+
+#include "check.h"
+
+/* FIPS 180-1 and RFC 2202 test vectors */
+struct sha1_vector {
+	const char * data;
+	const char * digest;
+};
+
+static const struct sha1_vector sha1_vectors[] = {
+	{ "", "da39a3ee5e6b4b0d3255bfef95601890afd80709" },
+	{ "abc", "a9993e364706816aba3e25717850c26c9cd0d89d" },
+	{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+		"84983e441c3bd26ebaae4aa1f95129e5e54670f1" },
+	{ NULL, NULL }
+};
+
+struct hmac_vector {
+	const char * key;
+	const char * data;
+	const char * digest;
+};
+
+/* key and data in hex */
+static const struct hmac_vector hmac_vectors[] = {
+	{ "0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b",
+		"4869205468657265",
+		"b617318655057264e28bc0b6fb378c8ef146be00" },
+	{ "4a656665",
+		"7768617420646f2079612077616e7420666f72206e6f7468696e673f",
+		"effcdf6ae5eb2fa2d27416d5f184df9c259a7c79" },
+	{ "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+		"dddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddddd"
+		"dddddddddddddddddddddddddddddddddddd",
+		"125d7342b9ac11cd91a39af48aa17b4f63f175d3" },
+	/* keys longer than a block are hashed first */
+	{ "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+		"54657374205573696e67204c6172676572205468616e20426c6f636b2d53697a"
+		"65204b6579202d2048617368204b6579204669727374",
+		"aa4ae5e15272d00e95705637ce8a3b55ed402112" },
+	{ "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+		"54657374205573696e67204c6172676572205468616e20426c6f636b2d53697a"
+		"65204b657920616e64204c6172676572205468616e204f6e6520426c6f636b2d"
+		"53697a652044617461",
+		"e8e99d0f45237d786d6bbaa7965c7808bbff1a91" },
+	{ NULL, NULL, NULL }
+};
+
+/*** check_sha1 ***/
+static void check_sha1(void) {
+	const struct sha1_vector * vector;
+	struct sha1 ctx;
+	uint8_t digest[SHA1_HASHLEN], expect[SHA1_HASHLEN], block[1000];
+	size_t i, len;
+
+	for (vector = sha1_vectors; vector->data != NULL; vector++) {
+		check_unhex(expect, vector->digest);
+
+		sha1_init(&ctx);
+		sha1_update(&ctx, vector->data, strlen(vector->data));
+		sha1_final(&ctx, digest);
+		CHECK_MEM(digest, expect, SHA1_HASHLEN);
+
+		/* byte by byte, to cross block boundaries in update */
+		sha1_init(&ctx);
+		for (i = 0; i < strlen(vector->data); i++)
+			sha1_update(&ctx, vector->data + i, 1);
+		sha1_final(&ctx, digest);
+		CHECK_MEM(digest, expect, SHA1_HASHLEN);
+	}
+
+	/* one million times 'a', in odd chunks */
+	memset(block, 'a', sizeof(block));
+	sha1_init(&ctx);
+	for (len = 0; len < 1000000; len += i) {
+		i = 1000000 - len < 997 ? 1000000 - len : 997;
+		sha1_update(&ctx, block, i);
+	}
+	sha1_final(&ctx, digest);
+	check_unhex(expect, "34aa973cd4c4daa4f61eeb2bdbad27316534016f");
+	CHECK_MEM(digest, expect, SHA1_HASHLEN);
+}
+
+/*** check_hmac_sha1 ***/
+static void check_hmac_sha1(void) {
+	const struct hmac_vector * vector;
+	uint8_t key[256], data[256], digest[SHA1_HASHLEN], expect[SHA1_HASHLEN];
+	size_t key_len, data_len;
+
+	for (vector = hmac_vectors; vector->key != NULL; vector++) {
+		key_len = check_unhex(key, vector->key);
+		data_len = check_unhex(data, vector->data);
+		check_unhex(expect, vector->digest);
+
+		hmac_sha1(key, key_len, data, data_len, digest);
+		CHECK_MEM(digest, expect, SHA1_HASHLEN);
+	}
+}
+
+/*** check_hkdf ***/
+static void check_hkdf(void) {
+	uint8_t ikm[11], salt[13], info[10 + SHA1_HASHLEN + 1], prk[SHA1_HASHLEN];
+	uint8_t okm[3 * SHA1_HASHLEN], expect[42];
+	size_t info_len, t_len = 0;
+	uint8_t i;
+
+	/* RFC 5869 test case 4, built from hmac_sha1() the way
+	 * ykfde_derive_passphrase() does, but with three blocks */
+	check_unhex(ikm, "0b0b0b0b0b0b0b0b0b0b0b");
+	check_unhex(salt, "000102030405060708090a0b0c");
+
+	hmac_sha1(salt, sizeof(salt), ikm, sizeof(ikm), prk);
+	check_unhex(expect, "9b6c18c432a7bf8f0e71c8eb88f4b30baa2ba243");
+	CHECK_MEM(prk, expect, SHA1_HASHLEN);
+
+	for (i = 1; i <= 3; i++) {
+		/* T(i) = HMAC(PRK, T(i - 1) | info | i) */
+		if (t_len > 0)
+			memcpy(info, okm + (i - 2) * SHA1_HASHLEN, SHA1_HASHLEN);
+		info_len = t_len + check_unhex(info + t_len, "f0f1f2f3f4f5f6f7f8f9");
+		info[info_len++] = i;
+		hmac_sha1(prk, SHA1_HASHLEN, info, info_len, okm + (i - 1) * SHA1_HASHLEN);
+		t_len = SHA1_HASHLEN;
+	}
+
+	check_unhex(expect, "085a01ea1b10f36933068b56efa5ad81a4f14b822f5b091568a9cdd4f155fda2"
+			"c22e422478d305f3f896");
+	CHECK_MEM(okm, expect, sizeof(expect));
+}
+
+/*** check_derive_passphrase ***/
+static void check_derive_passphrase(void) {
+	const char * passphrase = "0123456789abcdef0123456789abcdef01234567";
+	char derived[YKFDE_PASSPHRASELEN + 1], other[YKFDE_PASSPHRASELEN + 1];
+
+	/* the derivation is part of the on-disk format, keyslots are
+	 * enrolled with it - it must never change */
+	memset(derived, 0, sizeof(derived));
+	CHECK(ykfde_derive_passphrase(passphrase, "0b9f6a1c-3d2e-4f50-8a7b-6c5d4e3f2a10",
+				derived) == EXIT_SUCCESS);
+	CHECK_STR(derived, "0f92729f63321141dd6e859e43bc6af734b095a6");
+
+	/* every device gets its own */
+	memset(other, 0, sizeof(other));
+	CHECK(ykfde_derive_passphrase(passphrase, "0b9f6a1c-3d2e-4f50-8a7b-6c5d4e3f2a11",
+				other) == EXIT_SUCCESS);
+	CHECK_STR(other, "28865844a4c61a6772b42b9364ff05a97fde0ed3");
+
+	/* LUKS1 devices have no UUID, too long is invalid */
+	CHECK(ykfde_derive_passphrase(passphrase, NULL, derived) == EXIT_FAILURE);
+	CHECK(ykfde_derive_passphrase(passphrase,
+				"0b9f6a1c-3d2e-4f50-8a7b-6c5d4e3f2a10-0", derived) == EXIT_FAILURE);
+}
+
+/*** main ***/
+int main(int argc, char ** argv) {
+	check_sha1();
+	check_hmac_sha1();
+	check_hkdf();
+	check_derive_passphrase();
+
+	return CHECK_EXIT();
+}
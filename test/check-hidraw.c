@@ -0,0 +1,115 @@
+/*
+ * (C) 2014-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "../bin/sha1.c"
+#include "../bin/backend.c"
+
+#include "check.h"
+
+/*** check_crc ***/
+static void check_crc(void) {
+	/* CRC-16 as in ISO 13239, without final xor */
+	CHECK(yubikey_crc16((const uint8_t *) "123456789", 9) == 0x6f91);
+}
+
+/*** check_frame ***/
+static void check_frame(void) {
+	uint8_t reports[HIDRAW_CHUNKS][HIDRAW_REPORT_SIZE], frame[sizeof(struct hidraw_frame)];
+	unsigned char challenge[SHA1_MAX_BLOCK_SIZE + 1];
+	unsigned int count, i;
+	uint8_t seq;
+
+	CHECK(HIDRAW_CHUNKS * HIDRAW_DATA_SIZE == sizeof(struct hidraw_frame));
+
+	/* a request without data, for serial: first and last chunk */
+	memset(reports, 0xff, sizeof(reports));
+	count = hidraw_frame(SLOT_DEVICE_SERIAL, NULL, 0, reports);
+	CHECK(count == 2);
+	CHECK(reports[0][HIDRAW_REPORT_SIZE - 1] == (HIDRAW_WRITE_FLAG | 0));
+	CHECK(reports[1][HIDRAW_REPORT_SIZE - 1] == (HIDRAW_WRITE_FLAG | (HIDRAW_CHUNKS - 1)));
+	for (i = 0; i < HIDRAW_DATA_SIZE; i++)
+		CHECK(reports[0][i] == 0);
+	/* the last chunk has last byte of payload, then slot and crc */
+	CHECK(reports[1][1] == SLOT_DEVICE_SERIAL);
+
+	/* a full challenge goes in all chunks, in order */
+	for (i = 0; i < sizeof(challenge); i++)
+		challenge[i] = i + 1;
+	count = hidraw_frame(SLOT_CHAL_HMAC2, challenge, SHA1_MAX_BLOCK_SIZE, reports);
+	CHECK(count == HIDRAW_CHUNKS);
+	for (i = 0; i < count; i++) {
+		CHECK(reports[i][HIDRAW_REPORT_SIZE - 1] == (HIDRAW_WRITE_FLAG | i));
+		memcpy(frame + i * HIDRAW_DATA_SIZE, reports[i], HIDRAW_DATA_SIZE);
+	}
+	CHECK_MEM(frame, challenge, SHA1_MAX_BLOCK_SIZE);
+	CHECK(frame[SHA1_MAX_BLOCK_SIZE] == SLOT_CHAL_HMAC2);
+	CHECK(yubikey_crc16(frame, SHA1_MAX_BLOCK_SIZE) ==
+			(frame[SHA1_MAX_BLOCK_SIZE + 1] | frame[SHA1_MAX_BLOCK_SIZE + 2] << 8));
+
+	/* chunks of zeros are skipped, but sequence numbers stay */
+	memset(challenge + HIDRAW_DATA_SIZE, 0, 2 * HIDRAW_DATA_SIZE);
+	count = hidraw_frame(SLOT_CHAL_HMAC1, challenge, SHA1_MAX_BLOCK_SIZE, reports);
+	CHECK(count == HIDRAW_CHUNKS - 2);
+	for (i = 0, seq = 0; i < count; i++, seq++) {
+		if (seq == 1)
+			seq += 2;
+		CHECK(reports[i][HIDRAW_REPORT_SIZE - 1] == (HIDRAW_WRITE_FLAG | seq));
+	}
+
+	/* too long */
+	CHECK(hidraw_frame(SLOT_CHAL_HMAC2, challenge, SHA1_MAX_BLOCK_SIZE + 1, reports) == 0);
+}
+
+/*** check_crc_ok ***/
+static void check_crc_ok(void) {
+	uint8_t buffer[sizeof(struct hidraw_frame)];
+	uint16_t crc;
+	unsigned int i;
+
+	/* a response is followed by the complement of its crc */
+	memset(buffer, 0, sizeof(buffer));
+	for (i = 0; i < SHA1_DIGEST_SIZE; i++)
+		buffer[i] = i * 7;
+	crc = ~yubikey_crc16(buffer, SHA1_DIGEST_SIZE);
+	buffer[SHA1_DIGEST_SIZE] = crc & 0xff;
+	buffer[SHA1_DIGEST_SIZE + 1] = crc >> 8;
+
+	CHECK(hidraw_crc_ok(buffer, 3 * HIDRAW_DATA_SIZE + 1, SHA1_DIGEST_SIZE) == true);
+	CHECK(hidraw_crc_ok(buffer, sizeof(buffer), SHA1_DIGEST_SIZE) == true);
+
+	/* what we read is too short */
+	CHECK(hidraw_crc_ok(buffer, SHA1_DIGEST_SIZE + 1, SHA1_DIGEST_SIZE) == false);
+
+	/* any bit flipped */
+	for (i = 0; i < (SHA1_DIGEST_SIZE + 2) * 8; i++) {
+		buffer[i / 8] ^= 1 << (i % 8);
+		CHECK(hidraw_crc_ok(buffer, sizeof(buffer), SHA1_DIGEST_SIZE) == false);
+		buffer[i / 8] ^= 1 << (i % 8);
+	}
+}
+
+/*** main ***/
+int main(int argc, char ** argv) {
+	check_crc();
+	check_frame();
+	check_crc_ok();
+
+	return CHECK_EXIT();
+}
@@ -0,0 +1,245 @@
+/*
+ * (C) 2014-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#define main ykfde_cpio_main
+#include "../bin/ykfde-cpio.c"
+#undef main
+
+#include "../bin/sha1.c"
+#include "../bin/backend.c"
+#include "../bin/libykfde.c"
+
+#include "check.h"
+
+/* sequential serials, plus some that are spread */
+#define SERIALS		1000
+static const unsigned int serials_spread[] = { 4294967295u, 2147483648u, 99999999, 0 };
+
+/* files in challenge directory that are no challenge */
+static const char * const no_challenges[] = {
+	"challenge-0", "challenge-12x", "challenge-", "response-5", NULL
+};
+
+/* all in a temporary directory we change to */
+#define CHALLENGES	"challenges"
+#define INDEX		"index"
+#define CONFIG		"ykfde.conf"
+
+/*** write_file ***/
+static int write_file(const char * path, const char * data, size_t len) {
+	FILE * file;
+
+	if ((file = fopen(path, "w")) == NULL)
+		return EXIT_FAILURE;
+	fwrite(data, 1, len, file);
+
+	return fclose(file) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*** write_challenge ***/
+static void write_challenge(unsigned int serial) {
+	char path[32], challenge[YKFDE_CHALLENGELEN];
+
+	/* the content tells the serial */
+	memset(challenge, 'a' + serial % 26, sizeof(challenge));
+	snprintf(challenge, sizeof(challenge), "%u", serial);
+	snprintf(path, sizeof(path), CHALLENGES "/challenge-%u", serial);
+	CHECK(write_file(path, challenge, sizeof(challenge)) == EXIT_SUCCESS);
+}
+
+/*** check_challenge ***/
+static void check_challenge(unsigned int serial) {
+	char challenge[YKFDE_CHALLENGELEN], expect[YKFDE_CHALLENGELEN];
+
+	memset(expect, 'a' + serial % 26, sizeof(expect));
+	snprintf(expect, sizeof(expect), "%u", serial);
+	memset(challenge, 0, sizeof(challenge));
+	CHECK(ykfde_read_challenge(serial, challenge) == EXIT_SUCCESS);
+	CHECK_MEM(challenge, expect, sizeof(challenge));
+}
+
+/*** check_build ***/
+static void check_build(struct challenges * challenges, dictionary * ini) {
+	const struct index_entry * entries;
+	unsigned int i, used = 0;
+
+	CHECK(read_challenges(challenges) == EXIT_SUCCESS);
+	CHECK(build_index(challenges, ini) == EXIT_SUCCESS);
+	if (challenges->index == NULL)
+		return;
+
+	/* a power of two, at most half full */
+	CHECK(challenges->index->buckets >= 2 * challenges->index->count);
+	CHECK((challenges->index->buckets & (challenges->index->buckets - 1)) == 0);
+	CHECK(challenges->index->count == SERIALS + 3);
+	CHECK(challenges->index_size == sizeof(struct index_header) +
+			challenges->index->buckets * sizeof(struct index_entry));
+
+	entries = (const struct index_entry *) (challenges->index + 1);
+	for (i = 0; i < challenges->index->buckets; i++)
+		if (entries[i].serial != 0)
+			used++;
+	CHECK(used == challenges->index->count);
+
+	CHECK(challenges->index->flags == (INDEX_2NDFACTOR | INDEX_DERIVE));
+}
+
+/*** check_lookup ***/
+static void check_lookup(void) {
+	const struct index_entry * entry;
+	char challenge[YKFDE_CHALLENGELEN];
+	uint32_t flags = 0;
+	unsigned int i;
+
+	CHECK(ykfde_index_open(INDEX, &flags) == EXIT_SUCCESS);
+	CHECK(flags == (INDEX_2NDFACTOR | INDEX_DERIVE));
+	if (index_map == NULL)
+		return;
+
+	for (i = 1; i <= SERIALS; i++)
+		check_challenge(i);
+	for (i = 0; serials_spread[i] != 0; i++)
+		check_challenge(serials_spread[i]);
+
+	/* whatever is not a challenge is not found */
+	errno = 0;
+	CHECK(ykfde_read_challenge(SERIALS + 1, challenge) == EXIT_FAILURE);
+	CHECK(errno == ENOENT);
+	CHECK(ykfde_read_challenge(0, challenge) == EXIT_FAILURE);
+	CHECK(index_lookup(12) != NULL);
+	CHECK(index_lookup(5) != NULL);
+
+	/* config is resolved at build time */
+	if ((entry = index_lookup(12)) != NULL) {
+		CHECK(entry->yk_slot == 1);
+		CHECK(entry->luks_slot == 3);
+		CHECK_STR(entry->device_names, "root,home");
+	}
+	if ((entry = index_lookup(13)) != NULL) {
+		CHECK(entry->yk_slot == 2);
+		CHECK(entry->luks_slot == -1);
+		CHECK_STR(entry->device_names, "root");
+	}
+
+	ykfde_index_close();
+}
+
+/*** check_invalid ***/
+static void check_invalid(const struct challenges * challenges) {
+	struct index_header header;
+	uint32_t flags = 0;
+
+	/* a missing index is not an error */
+	CHECK(unlink(INDEX) == 0);
+	CHECK(ykfde_index_open(INDEX, &flags) == EXIT_FAILURE);
+
+	/* truncated */
+	CHECK(write_file(INDEX, (const char *) challenges->index,
+				challenges->index_size - 1) == EXIT_SUCCESS);
+	CHECK(ykfde_index_open(INDEX, &flags) == EXIT_FAILURE);
+
+	/* other version */
+	memcpy(&header, challenges->index, sizeof(header));
+	header.version++;
+	CHECK(write_file(INDEX, (const char *) &header, sizeof(header)) == EXIT_SUCCESS);
+	CHECK(ykfde_index_open(INDEX, &flags) == EXIT_FAILURE);
+
+	CHECK(index_map == NULL);
+	CHECK(flags == 0);
+}
+
+/*** remove_challenges ***/
+static void remove_challenges(void) {
+	struct dirent ** ents;
+	int fddir, count, i;
+
+	if ((fddir = open(CHALLENGES, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return;
+
+	if ((count = scandirat(fddir, ".", &ents, filter_dots, alphasort)) >= 0) {
+		for (i = 0; i < count; i++) {
+			unlinkat(fddir, ents[i]->d_name, 0);
+			free(ents[i]);
+		}
+		free(ents);
+	}
+
+	close(fddir);
+	rmdir(CHALLENGES);
+}
+
+/*** main ***/
+int main(int argc, char ** argv) {
+	struct challenges challenges;
+	dictionary * ini;
+	char dir[] = "/tmp/check-index-XXXXXX", path[32];
+	unsigned int i;
+	const char config[] =
+		"[general]\n"
+		CONF2NDFACTOR " = yes\n"
+		CONFDERIVE " = yes\n"
+		CONFDEVNAME " = root\n"
+		"[12]\n"
+		CONFYKSLOT " = 1\n"
+		CONFLUKSSLOT " = 3\n"
+		CONFDEVNAME " = root,home\n";
+
+	if (mkdtemp(dir) == NULL || chdir(dir) < 0) {
+		perror("Failed creating temporary directory");
+		return EXIT_FAILURE;
+	}
+	CHECK(mkdir(CHALLENGES, 0700) == 0);
+	setenv("YKFDE_CHALLENGEDIR", CHALLENGES, 1);
+
+	for (i = 1; i <= SERIALS; i++)
+		write_challenge(i);
+	for (i = 0; serials_spread[i] != 0; i++)
+		write_challenge(serials_spread[i]);
+	for (i = 0; no_challenges[i] != NULL; i++) {
+		snprintf(path, sizeof(path), CHALLENGES "/%s", no_challenges[i]);
+		CHECK(write_file(path, "x", 1) == EXIT_SUCCESS);
+	}
+
+	CHECK(write_file(CONFIG, config, sizeof(config) - 1) == EXIT_SUCCESS);
+	ini = iniparser_load(CONFIG);
+	CHECK(ini != NULL);
+
+	memset(&challenges, 0, sizeof(struct challenges));
+	check_build(&challenges, ini);
+	if (challenges.index != NULL) {
+		CHECK(write_file(INDEX, (const char *) challenges.index,
+					challenges.index_size) == EXIT_SUCCESS);
+		check_lookup();
+		check_invalid(&challenges);
+	}
+
+	free_challenges(&challenges);
+	if (ini != NULL)
+		iniparser_freedict(ini);
+
+	/* clean up, nothing is left behind */
+	remove_challenges();
+	unlink(INDEX);
+	unlink(CONFIG);
+	if (chdir("/") == 0)
+		rmdir(dir);
+
+	return CHECK_EXIT();
+}
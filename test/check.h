@@ -0,0 +1,57 @@
+/*
+ * (C) 2014-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _CHECK_H
+#define _CHECK_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The checks include the sources they test, so static functions
+ * can be called. A failed check is reported and counted, the
+ * program goes on and exits with failure in the end. */
+static unsigned int check_failed = 0;
+
+#define CHECK(expr) do { \
+	if (!(expr)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+		check_failed++; \
+	} \
+} while (0)
+
+#define CHECK_MEM(a, b, len)	CHECK(memcmp((a), (b), (len)) == 0)
+#define CHECK_STR(a, b)		CHECK(strcmp((a), (b)) == 0)
+
+#define CHECK_EXIT() (check_failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS)
+
+/*** check_unhex ***/
+static inline size_t check_unhex(uint8_t * dst, const char * hex) {
+	size_t len = 0;
+	unsigned int c;
+
+	while (sscanf(hex, "%2x", &c) == 1) {
+		dst[len++] = c;
+		hex += 2;
+	}
+
+	return len;
+}
+
+#endif /* _CHECK_H */
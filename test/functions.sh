@@ -0,0 +1,30 @@
+# (C) 2014-2026 by Christian Hesse <mail@eworm.de>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+
+# Helpers shared by boot-sim.sh and bench.sh, sourced.
+
+# percentiles of a list of numbers, one per line, as JSON
+percentiles() {
+	sort -n | awk '
+		{ v[NR] = $1 }
+		END {
+			if (NR == 0) { printf "null"; exit }
+			split("50 90 99 99.9", p, " ")
+			printf "{ "
+			for (i = 1; i <= 4; i++) {
+				n = int(NR * p[i] / 100 + 0.999999)
+				if (n < 1) n = 1
+				printf "\"p%s\": %d, ", p[i], v[n]
+			}
+			printf "\"max\": %d }", v[NR]
+		}'
+}
+
+# values of a numeric field from lines of JSON
+field() {
+	sed -n "s/.*\"${1}\": \\([0-9]*\\).*/\\1/p"
+}